@@ -25,16 +25,33 @@
 //        Interleaved (RGB RGB...)
 //        Order: RGB
 // If you wish that graphac output a more user-friendly file format, go right
-// ahead.
+// ahead.  If the graphics file name ends in .png, graphac writes a PNG instead.
 //
 // See mapac.c if you want to create a map file from your cell.dat.  This is not
-// done here.
+// done here, though -cell will shade a picture straight from a cell.dat.
+//
+// The picture is shaded in bands of rows on several threads.  By default one
+// thread is started per processor; use -threads to change that.  The output is
+// the same no matter how many threads are used.  Under Linux, compile with
+//    gcc -O2 graphac.c -o graphac -lm -lpthread
+// Add -mavx2 to get the 8-wide version of the -simd shading kernel.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#define MakeDir(name) _mkdir(name)
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define MakeDir(name) mkdir(name, 0755)
+#endif
+
 #define uchar  unsigned char
 #define ushort unsigned short
 #define uint   unsigned int
@@ -42,8 +59,23 @@
 
 #define LANDSIZE 2041
 
+// Forces a function to be inlined, so that constant arguments fold into it
+#if defined(_MSC_VER)
+#define INLINE __forceinline
+#elif defined(__GNUC__)
+#define INLINE __inline__ __attribute__((always_inline))
+#else
+#define INLINE
+#endif
+
+// Rows are handed out to the threads in bands of BANDROWS rows.  Each band is a
+// contiguous piece of the output, so two threads can only ever touch the same
+// cache line at the seam between two bands.
+#define BANDROWS 32
+
 // The following constants change how the lighting works.  It is easy to wash out
-// the bright whites of the snow, so be careful.
+// the bright whites of the snow, so be careful.  They are only the defaults;
+// see -config and -set below to change them without recompiling.
 
 // Incresing COLORCORRECTION makes the base color more prominant.
 #define COLORCORRECTION  70.0
@@ -60,170 +92,5548 @@ typedef struct {
   uchar  used;
 } landData;
 
-// This vector reprsents a light coming from the northwest corner of the map.
-// Pretend the sun is on the horizon at the northwest corner.
-double lightVector[3] = {
-  -1.0, -1.0, 0.0
-};
+// Everything that decides how the map is lit and colored.  The defaults below
+// are known at compile time, so ShadeRowDefault() gets them folded right into
+// its code.  -config and -set change the copy in lights, and any change makes
+// graphac shade through the generic ShadeRow() instead.
+#define MAXDIRECTIONS 8
+
+typedef struct {
+  double lightVector[3];
+  double colorCorrection;
+  double lightCorrection;
+  double ambientLight;
+  uchar  landColor[33][4];
+
+  // Extra light directions (x, y, z, weight) for multi-directional shading.
+  // When there are any, they are used in place of lightVector.
+  int    numDirections;
+  double direction[MAXDIRECTIONS][4];
+
+  // Cast shadows: the elevation of the sun in degrees, and how much of the
+  // direct light a point in full shadow loses (0 for no shadows)
+  double shadowElevation;
+  double shadowStrength;
+
+  // Ambient occlusion: how many directions to look for the horizon in, how
+  // many points to look out along each, and how much of its light a point with
+  // no sky left loses (0 for no occlusion)
+  int    occlusionDirections;
+  int    occlusionRadius;
+  double occlusionStrength;
+
+  // The PORTAL.DAT texture to draw each land type with instead of its
+  // landColor (0 for none), and how many points one copy of a texture covers
+  uint   texture[33];
+  double textureSize;
+
+  // How strongly the vegetation classes tint the picture (0 for not at all)
+  double vegetationStrength;
+} lighting;
+
+const lighting defaultLighting = {
+  // This vector reprsents a light coming from the northwest corner of the map.
+  // Pretend the sun is on the horizon at the northwest corner.
+  {-1.0, -1.0, 0.0},
+
+  COLORCORRECTION,
+  LIGHTCORRECTION,
+  AMBIENTLIGHT,
+
+  // These color values deserve the most comment in this file.  I edited my cell.dat
+  // to create strips of each land type.  A road passes over the end of each strip.
+  // I then took screenshots of each of the strips.  There were four strips in each
+  // screenshot.  I then cut out a piece of each of the strips and made a seperate
+  // image of each one.  Using the histogram feature in Paint Shop Pro, I found the
+  // average red, green, and blue values for each land type.  These are the numbers
+  // found below.  The fourth number in each group below is the average luminance
+  // of a control patch in each screenshot, in this case the road.  The control is
+  // needed since the screenshots were taken at slightly different times of the day
+  // and thus the general brightness of the scene is different.
+  //
+  // The last entry is the color for the roads.
+  {
+    {84, 67, 37, 110},
+    {56, 66, 21, 110},
+    {147, 154, 167, 110},
+    {51, 69, 10, 110},
+    {71, 37, 7, 113},
+    {54, 34, 23, 113},
+    {39, 35, 43, 113},
+    {89, 65, 34, 113},
+    {57, 41, 9, 113},
+    {44, 77, 2, 113},
+    {144, 99, 50, 113},
+    {132, 132, 97, 113},
+    {138, 93, 53, 114},
+    {111, 68, 41, 114},
+    {75, 85, 59, 114},
+    {208, 219, 233, 114},
+    {62, 108, 131, 130},
+    {20, 79, 56, 130},
+    {31, 80, 100, 130},
+    {44, 76, 94, 130},
+    {43, 59, 83, 130},
+    {34, 47, 6, 130},
+    {62, 108, 131, 130},
+    {30, 38, 26, 130},
+    {100, 79, 43, 130},
+    {45, 33, 33, 130},
+    {72, 72, 70, 130},
+    {197, 227, 242, 130},
+    {100, 79, 43, 130},
+    {100, 79, 43, 130},
+    {100, 79, 43, 130},
+    {100, 79, 43, 130},
+    {138, 130, 112, 130}
+  },
+
+  0,
+  {{0.0}},
 
-// These color values deserve the most comment in this file.  I edited my cell.dat
-// to create strips of each land type.  A road passes over the end of each strip.
-// I then took screenshots of each of the strips.  There were four strips in each
-// screenshot.  I then cut out a piece of each of the strips and made a seperate
-// image of each one.  Using the histogram feature in Paint Shop Pro, I found the
-// average red, green, and blue values for each land type.  These are the numbers
-// found below.  The fourth number in each group below is the average luminance
-// of a control patch in each screenshot, in this case the road.  The control is
-// needed since the screenshots were taken at slightly different times of the day
-// and thus the general brightness of the scene is different.
-//
-// The last entry is the color for the roads.
-uchar landColor[33][4] = {
-  {84, 67, 37, 110},
-  {56, 66, 21, 110},
-  {147, 154, 167, 110},
-  {51, 69, 10, 110},
-  {71, 37, 7, 113},
-  {54, 34, 23, 113},
-  {39, 35, 43, 113},
-  {89, 65, 34, 113},
-  {57, 41, 9, 113},
-  {44, 77, 2, 113},
-  {144, 99, 50, 113},
-  {132, 132, 97, 113},
-  {138, 93, 53, 114},
-  {111, 68, 41, 114},
-  {75, 85, 59, 114},
-  {208, 219, 233, 114},
-  {62, 108, 131, 130},
-  {20, 79, 56, 130},
-  {31, 80, 100, 130},
-  {44, 76, 94, 130},
-  {43, 59, 83, 130},
-  {34, 47, 6, 130},
-  {62, 108, 131, 130},
-  {30, 38, 26, 130},
-  {100, 79, 43, 130},
-  {45, 33, 33, 130},
-  {72, 72, 70, 130},
-  {197, 227, 242, 130},
-  {100, 79, 43, 130},
-  {100, 79, 43, 130},
-  {100, 79, 43, 130},
-  {100, 79, 43, 130},
-  {138, 130, 112, 130}
+  0.0,
+  0.0,
+
+  0,
+  0,
+  0.0,
+
+  {0},
+  1.0,
+
+  0.0
 };
 
+lighting lights;
+
+// How deep in shadow each point is, from 0 (lit) to 255, or NULL without shadows
+uchar *shadowMask;
+
+// How much of the sky each point cannot see, from 0 to 255, or NULL without
+// ambient occlusion
+uchar *occlusionMask;
+
 landData land[LANDSIZE][LANDSIZE];
-uchar    topo[LANDSIZE][LANDSIZE][3];
 
-void PrintUsage()
+// The points of the map in the picture, from (regionX0, regionY0) to
+// (regionX1, regionY1), see Regions below
+int regionX0 = 0, regionY0 = 0, regionX1 = LANDSIZE - 1, regionY1 = LANDSIZE - 1;
+
+// Threads
+//
+// A small pool of worker threads is started once.  RunJob() hands the same job
+// function to every worker (and the calling thread) and returns when they have
+// all finished.  Jobs split their own work up, usually by taking band numbers
+// from a shared counter with AtomicAdd().
+
+typedef void (*jobFunc)(void *ctx);
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION   mutex;
+typedef CONDITION_VARIABLE condition;
+#define MutexInit(m)     InitializeCriticalSection(m)
+#define MutexLock(m)     EnterCriticalSection(m)
+#define MutexUnlock(m)   LeaveCriticalSection(m)
+#define CondInit(c)      InitializeConditionVariable(c)
+#define CondWait(c, m)   SleepConditionVariableCS(c, m, INFINITE)
+#define CondBroadcast(c) WakeAllConditionVariable(c)
+#define AtomicAdd(p, n)  InterlockedExchangeAdd((volatile LONG *)(p), (n))
+#else
+typedef pthread_mutex_t    mutex;
+typedef pthread_cond_t     condition;
+#define MutexInit(m)     pthread_mutex_init(m, NULL)
+#define MutexLock(m)     pthread_mutex_lock(m)
+#define MutexUnlock(m)   pthread_mutex_unlock(m)
+#define CondInit(c)      pthread_cond_init(c, NULL)
+#define CondWait(c, m)   pthread_cond_wait(c, m)
+#define CondBroadcast(c) pthread_cond_broadcast(c)
+#define AtomicAdd(p, n)  __sync_fetch_and_add((p), (n))
+#endif
+
+int       numThreads;
+mutex     poolLock;
+condition poolStart, poolDone;
+jobFunc   poolJob;
+void      *poolCtx;
+int       poolGeneration, poolBusy;
+
+int NumProcessors()
 {
-  printf("usgae:\n");
-  printf("graphac <MAP FILE> <RAW GRAPHICS FILE\n");
+#ifdef _WIN32
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int)n : 1;
+#endif
 }
 
-int main(int argc, char *argv[])
+#ifdef _WIN32
+DWORD WINAPI PoolWorker(LPVOID arg)
+#else
+void *PoolWorker(void *arg)
+#endif
+{
+  int     seen;
+  jobFunc job;
+  void    *ctx;
+
+  (void)arg;
+  seen = 0;
+  while (1) {
+    MutexLock(&poolLock);
+    while (poolGeneration == seen)
+      CondWait(&poolStart, &poolLock);
+    seen = poolGeneration;
+    job = poolJob;
+    ctx = poolCtx;
+    MutexUnlock(&poolLock);
+
+    job(ctx);
+
+    MutexLock(&poolLock);
+    poolBusy--;
+    if (poolBusy == 0)
+      CondBroadcast(&poolDone);
+    MutexUnlock(&poolLock);
+  }
+
+  return 0;
+}
+
+void StartThreads()
+{
+  int i;
+#ifdef _WIN32
+  HANDLE    handle;
+#else
+  pthread_t handle;
+#endif
+
+  MutexInit(&poolLock);
+  CondInit(&poolStart);
+  CondInit(&poolDone);
+  poolGeneration = 0;
+  poolBusy = 0;
+
+  // The calling thread does its share of every job, so it is not started here
+  for (i = 1; i < numThreads; i++) {
+#ifdef _WIN32
+    handle = CreateThread(NULL, 0, PoolWorker, NULL, 0, NULL);
+    if (handle == NULL) {
+      printf("WARNING: Only %d threads could be started.\n", i);
+      numThreads = i;
+      return;
+    }
+    CloseHandle(handle);
+#else
+    if (pthread_create(&handle, NULL, PoolWorker, NULL) != 0) {
+      printf("WARNING: Only %d threads could be started.\n", i);
+      numThreads = i;
+      return;
+    }
+    pthread_detach(handle);
+#endif
+  }
+}
+
+void RunJob(jobFunc job, void *ctx)
+{
+  if (numThreads <= 1) {
+    job(ctx);
+    return;
+  }
+
+  MutexLock(&poolLock);
+  poolJob = job;
+  poolCtx = ctx;
+  poolBusy = numThreads - 1;
+  poolGeneration++;
+  CondBroadcast(&poolStart);
+  MutexUnlock(&poolLock);
+
+  job(ctx);
+
+  MutexLock(&poolLock);
+  while (poolBusy > 0)
+    CondWait(&poolDone, &poolLock);
+  MutexUnlock(&poolLock);
+}
+
+// Shading
+
+// Calculates the lighting scalar for the (unnormalized) normal v.  With
+// several light directions, each one lights the point as max(0, cos) of the
+// angle between them, and these are blended by weight.  A flat point under
+// lights 30 degrees up gets the same light as under the default horizon light.
+static INLINE double Light(const lighting *lt, double v[3])
+{
+  double sum, weights, d;
+  int    k;
+
+  if (lt->numDirections > 0) {
+    sum = 0.0;
+    weights = 0.0;
+    for (k = 0; k < lt->numDirections; k++) {
+      d = (lt->direction[k][0] * v[0] + lt->direction[k][1] * v[1] + lt->direction[k][2] * v[2]) /
+          sqrt((lt->direction[k][0] * lt->direction[k][0] + lt->direction[k][1] * lt->direction[k][1] +
+          lt->direction[k][2] * lt->direction[k][2]) * (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]));
+      if (d > 0.0)
+        sum += lt->direction[k][3] * d;
+      weights += lt->direction[k][3];
+    }
+    return sum / weights * 256.0 * lt->lightCorrection + lt->ambientLight;
+  }
+
+  return (((lt->lightVector[0] * v[0] + lt->lightVector[1] * v[1] + lt->lightVector[2] * v[2]) /
+      sqrt((lt->lightVector[0] * lt->lightVector[0] + lt->lightVector[1] * lt->lightVector[1] +
+      lt->lightVector[2] * lt->lightVector[2]) * (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]))) * 128.0 + 128.0) *
+      lt->lightCorrection + lt->ambientLight;
+}
+
+// Applies the lighting scalar to the base colors of a land type
+static INLINE void ApplyLight(const lighting *lt, int type, double light, uchar *out)
 {
-  FILE   *mapFile, *topoFile;
-  int    x, y;
   int    i;
+  double color;
+
+  for (i = 0; i < 3; i++) {
+    color = (lt->landColor[type][i] * lt->colorCorrection / lt->landColor[type][3]) * light / 256.0;
+    if (color > 255.0)
+      out[i] = 255;
+    else if (color < 0.0)
+      out[i] = 0;
+    else
+      out[i] = (uchar)color;
+  }
+}
+
+// Returns the shadowMask value of point (x, y)
+static INLINE int ShadowAt(int x, int y)
+{
+  return (shadowMask != NULL) ? shadowMask[y * LANDSIZE + x] : 0;
+}
+
+// Returns the occlusionMask value of point (x, y)
+static INLINE int OcclusionAt(int x, int y)
+{
+  return (occlusionMask != NULL) ? occlusionMask[y * LANDSIZE + x] : 0;
+}
+
+// Darkens a lighting scalar by shadow and occlusion values (0 to 255).  Shadow
+// takes away part of the direct light, but none of the ambient; occlusion
+// takes away part of both.
+static INLINE double DarkenBy(const lighting *lt, double light, double shadow, double occlusion)
+{
+  if (shadow > 0.0)
+    light = (light - lt->ambientLight) * (1.0 - lt->shadowStrength * shadow / 255.0) + lt->ambientLight;
+  if (occlusion > 0.0)
+    light *= 1.0 - lt->occlusionStrength * occlusion / 255.0;
+  return light;
+}
+
+// Darkens the lighting scalar of point (x, y) by its shadow and occlusion
+static INLINE double Darken(const lighting *lt, double light, int x, int y)
+{
+  return DarkenBy(lt, light, (lt->shadowStrength > 0.0) ? ShadowAt(x, y) : 0,
+      (lt->occlusionStrength > 0.0) ? OcclusionAt(x, y) : 0);
+}
+
+// Shades the point at x in row y.  prev and next are the rows above and below
+// row, or NULL at the top and bottom edges of the map.
+static INLINE void ShadePoint(const lighting *lt, landData *prev, landData *row, landData *next, int x, int y,
+    uchar *out)
+{
   ushort type;
-  double color, light;
   double v[3];
-  
-  if (argc != 3) {
-    printf("ERROR: Incorrect number of arguments!\n");
-    PrintUsage();
-    return -1;
+
+  if (row[x].used) {
+    // Calculate normal by using surrounding z values, if they exist
+    v[0] = 0.0;
+    v[1] = 0.0;
+    v[2] = 0.0;
+    if ((x < LANDSIZE - 1) && (next != NULL)) {
+      if (row[x + 1].used && next[x].used) {
+        v[0] -= row[x + 1].z - row[x].z;
+        v[1] -= next[x].z - row[x].z;
+        v[2] += 12.0;
+      }
+    }
+    if ((x > 0) && (next != NULL)) {
+      if (row[x - 1].used && next[x].used) {
+        v[0] += row[x - 1].z - row[x].z;
+        v[1] -= next[x].z - row[x].z;
+        v[2] += 12.0;
+      }
+    }
+    if ((x > 0) && (prev != NULL)) {
+      if (row[x - 1].used && prev[x].used) {
+        v[0] += row[x - 1].z - row[x].z;
+        v[1] += prev[x].z - row[x].z;
+        v[2] += 12.0;
+      }
+    }
+    if ((x < LANDSIZE - 1) && (prev != NULL)) {
+      if (row[x + 1].used && prev[x].used) {
+        v[0] -= row[x + 1].z - row[x].z;
+        v[1] += prev[x].z - row[x].z;
+        v[2] += 12.0;
+      }
+    }
+
+    // Check for road bit(s)
+    if ((row[x].type & 0x0003) != 0)
+      type = 32;
+    else
+      type = (row[x].type & 0x00FF) >> 2;
+
+    ApplyLight(lt, type, Darken(lt, Light(lt, v), x, y), out);
   }
+  else {
+    // If data is not present for a point on the map, the resultant pixel is green
+    out[0] = 0;
+    out[1] = 0xFF;
+    out[2] = 0;
+  }
+}
 
-  // Read map file
-  mapFile = fopen(argv[1], "rb");
-  if (mapFile == NULL) {
-    printf("ERROR: File %s could not be opened!\n", argv[1]);
-    return -1;
+// Returns the index into landColor for a point
+static INLINE int LandType(landData *point)
+{
+  // Check for road bit(s)
+  if ((point->type & 0x0003) != 0)
+    return 32;
+  return (point->type & 0x00FF) >> 2;
+}
+
+// Calculates the same normal as ShadePoint(), in integers.  v[2] is 12 times
+// the returned number of neighbour pairs used.
+static INLINE int IntNormal(landData *prev, landData *row, landData *next, int x, int *v0, int *v1)
+{
+  int z, left, right, up, down, count;
+
+  z = row[x].z;
+  left = (x > 0) && row[x - 1].used;
+  right = (x < LANDSIZE - 1) && row[x + 1].used;
+  up = (prev != NULL) && prev[x].used;
+  down = (next != NULL) && next[x].used;
+  *v0 = 0;
+  *v1 = 0;
+  count = 0;
+  if (right && down) {
+    *v0 -= row[x + 1].z - z;
+    *v1 -= next[x].z - z;
+    count++;
   }
-  fread(land, sizeof(landData), LANDSIZE * LANDSIZE, mapFile);
-  fclose(mapFile);
+  if (left && down) {
+    *v0 += row[x - 1].z - z;
+    *v1 -= next[x].z - z;
+    count++;
+  }
+  if (left && up) {
+    *v0 += row[x - 1].z - z;
+    *v1 += prev[x].z - z;
+    count++;
+  }
+  if (right && up) {
+    *v0 -= row[x + 1].z - z;
+    *v1 += prev[x].z - z;
+    count++;
+  }
+  return count;
+}
 
-  topoFile = fopen(argv[2], "wb");
-  if (topoFile == NULL) {
-    printf("ERROR: File %s could not be opened!\n", argv[2]);
-    return -1;
+// Shades one row of the map with the lighting in lights.  This is the reference
+// path; everything else is checked against it.
+void ShadeRow(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  int x;
+
+  for (x = 0; x < LANDSIZE; x++)
+    ShadePoint(&lights, prev, row, next, x, y, &out[x * 3]);
+}
+
+// Shades one row of the map with the default lighting, which the compiler
+// can fold into the code
+void ShadeRowDefault(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  int x;
+
+  for (x = 0; x < LANDSIZE; x++)
+    ShadePoint(&defaultLighting, prev, row, next, x, y, &out[x * 3]);
+}
+
+// Normal cache
+//
+// -normals keeps the normals of the map in <MAP FILE>.nrm, so that they do not
+// have to be worked out on every run.  The normal of a point depends only on
+// the z and used of it and its neighbours, so it is stored as the numbers from
+// IntNormal(), which are exact: v[0] and v[1] in 11 bits each and the number
+// of neighbour pairs in 3, packed into a uint.  The file is:
+//
+// uchar Valid[255][255]         Nonzero where a landblock's normals are good
+// uint  Normal[2041][2041]      Packed as above, in the same order as the map
+//
+// mapac clears Valid for every landblock it marks dirty.  graphac redoes the
+// normals of the landblocks that are not valid and writes the file back if
+// any were.  ShadeRowCached() is ShadeRow() with its normals from the cache,
+// ShadeRowDefaultCached() is ShadeRowDefault() with them, and the lookup
+// table, multi-directional, textured, -scale and -variant shading take them
+// from there too.  Only the -simd kernel works the normals out along with
+// everything else, faster than they can be read, so it does not use the cache.
+
+uint *normalCache;
+
+static INLINE uint PackNormal(int v0, int v1, int count)
+{
+  return (uint)(v0 & 0x7FF) | (uint)(v1 & 0x7FF) << 11 | (uint)count << 22;
+}
+
+// Returns the normal of the point at x in row y as IntNormal() does, from the
+// cache if there is one
+static INLINE int PointNormal(landData *prev, landData *row, landData *next, int x, int y, int *v0, int *v1)
+{
+  uint n;
+
+  if (normalCache == NULL)
+    return IntNormal(prev, row, next, x, v0, v1);
+  n = normalCache[y * LANDSIZE + x];
+  *v0 = (int)(n & 0x7FF);
+  *v1 = (int)((n >> 11) & 0x7FF);
+  if (*v0 >= 0x400)
+    *v0 -= 0x800;
+  if (*v1 >= 0x400)
+    *v1 -= 0x800;
+  return (int)(n >> 22);
+}
+
+void ShadeRowCached(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  double v[3];
+  int    x, v0, v1, count;
+
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if (!row[x].used) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = 12.0 * count;
+    ApplyLight(&lights, LandType(&row[x]), Darken(&lights, Light(&lights, v), x, y), out);
   }
+}
 
-  for (y = 0; y < LANDSIZE; y++) {
-    for (x = 0; x < LANDSIZE; x++) {
-      if (land[y][x].used) {
-        // Calculate normal by using surrounding z values, if they exist
-        v[0] = 0.0;
-        v[1] = 0.0;
-        v[2] = 0.0;
-        if ((x < LANDSIZE - 1) && (y < LANDSIZE - 1)) {
-          if (land[y][x + 1].used && land[y + 1][x].used) {
-            v[0] -= land[y][x + 1].z - land[y][x].z;
-            v[1] -= land[y + 1][x].z - land[y][x].z;
-            v[2] += 12.0;
-          }
-        }
-        if ((x > 0) && (y < LANDSIZE - 1)) {
-          if (land[y][x - 1].used && land[y + 1][x].used) {
-            v[0] += land[y][x - 1].z - land[y][x].z;
-            v[1] -= land[y + 1][x].z - land[y][x].z;
-            v[2] += 12.0;
-          }
-        }
-        if ((x > 0) && (y > 0)) {
-          if (land[y][x - 1].used && land[y - 1][x].used) {
-            v[0] += land[y][x - 1].z - land[y][x].z;
-            v[1] += land[y - 1][x].z - land[y][x].z;
-            v[2] += 12.0;
-          }
-        }
-        if ((x < LANDSIZE - 1) && (y > 0)) {
-          if (land[y][x + 1].used && land[y - 1][x].used) {
-            v[0] -= land[y][x + 1].z - land[y][x].z;
-            v[1] += land[y - 1][x].z - land[y][x].z;
-            v[2] += 12.0;
-          }
-        }
+// ShadeRowCached() with the default lighting, which the compiler can fold in
+void ShadeRowDefaultCached(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  double v[3];
+  int    x, v0, v1, count;
 
-        // Check for road bit(s)
-        if ((land[y][x].type & 0x0003) != 0)
-          type = 32;
-        else
-          type = (land[y][x].type & 0x00FF) >> 2;
-
-        // Calculate lighting scalar
-        light = (((lightVector[0] * v[0] + lightVector[1] * v[1] + lightVector[2] * v[2]) /
-            sqrt((lightVector[0] * lightVector[0] + lightVector[1] * lightVector[1] + lightVector[2] * lightVector[2]) *
-            (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]))) * 128.0 + 128.0) * LIGHTCORRECTION + AMBIENTLIGHT;
-
-        // Apply lighting scalar to base colors
-        for (i = 0; i < 3; i++) {
-          color = (landColor[type][i] * COLORCORRECTION / landColor[type][3]) * light / 256.0;
-          if (color > 255.0)
-            topo[y][x][i] = 255;
-          else if (color < 0.0)
-            topo[y][x][i] = 0;
-          else
-            topo[y][x][i] = (uchar)color;
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if (!row[x].used) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = 12.0 * count;
+    ApplyLight(&defaultLighting, LandType(&row[x]),
+        Darken(&defaultLighting, Light(&defaultLighting, v), x, y), out);
+  }
+}
+
+// Reads the normal cache of the map, redoing the landblocks that are not valid
+int LoadNormals(char *mapName)
+{
+  static uchar valid[255][255];
+  FILE         *nrmFile;
+  char         *fileName;
+  landData     *prev, *next;
+  int          bx, by, x, y, x0, y0, v0, v1, count, numRedone;
+
+  fileName = (char *)malloc(strlen(mapName) + 5);
+  sprintf(fileName, "%s.nrm", mapName);
+  normalCache = (uint *)malloc(LANDSIZE * LANDSIZE * sizeof(uint));
+  if ((fileName == NULL) || (normalCache == NULL)) {
+    printf("ERROR: Out of memory!\n");
+    return 0;
+  }
+
+  // A missing or short file is simply not valid
+  memset(valid, 0, sizeof(valid));
+  nrmFile = fopen(fileName, "rb");
+  if (nrmFile != NULL) {
+    if ((fread(valid, sizeof(valid), 1, nrmFile) != 1) ||
+        (fread(normalCache, sizeof(uint), LANDSIZE * LANDSIZE, nrmFile) != LANDSIZE * LANDSIZE))
+      memset(valid, 0, sizeof(valid));
+    fclose(nrmFile);
+  }
+
+  numRedone = 0;
+  for (bx = 0; bx < 255; bx++) {
+    for (by = 0; by < 255; by++) {
+      if (valid[bx][by])
+        continue;
+      x0 = bx * 8;
+      y0 = LANDSIZE - 1 - by * 8 - 8;
+      for (y = y0; y <= y0 + 8; y++) {
+        prev = (y > 0) ? land[y - 1] : NULL;
+        next = (y < LANDSIZE - 1) ? land[y + 1] : NULL;
+        for (x = x0; x <= x0 + 8; x++) {
+          count = IntNormal(prev, land[y], next, x, &v0, &v1);
+          normalCache[y * LANDSIZE + x] = PackNormal(v0, v1, count);
         }
       }
+      valid[bx][by] = 1;
+      numRedone++;
+    }
+  }
+
+  if (numRedone > 0) {
+    nrmFile = fopen(fileName, "wb");
+    if (nrmFile == NULL) {
+      printf("ERROR: File %s could not be opened!\n", fileName);
+      free(fileName);
+      return 0;
+    }
+    fwrite(valid, sizeof(valid), 1, nrmFile);
+    fwrite(normalCache, sizeof(uint), LANDSIZE * LANDSIZE, nrmFile);
+    fclose(nrmFile);
+  }
+  printf("Normals of %d land blocks redone.\n", numRedone);
+  free(fileName);
+  return 1;
+}
+
+// SIMD shading
+//
+// ShadeRowSIMD() does the same math as ShadeRow() on SIMDWIDTH points at a time
+// in single precision: 8 with AVX2 (compile with -mavx2), otherwise 4 with SSE2.
+// The four neighbour tests become lane masks.  Because of the float math a
+// channel may come out one lower or higher than the reference; -verify checks
+// that no channel is off by more than SIMDTOLERANCE.  The first and last point
+// of each row, and the first and last rows, go through ShadePoint().
+
+#define SIMDTOLERANCE 1
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMDWIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMDWIDTH 4
+#else
+#define SIMDWIDTH 1
+#endif
+
+// Base colors premultiplied by colorCorrection / control / 256, one array per
+// channel so the vector code can look them up by type
+float colorScale[3][33];
+
+void InitColorScale()
+{
+  int type, i;
+
+  for (type = 0; type < 33; type++) {
+    for (i = 0; i < 3; i++)
+      colorScale[i][type] = (float)(lights.landColor[type][i] * lights.colorCorrection /
+          lights.landColor[type][3] / 256.0);
+  }
+}
+
+#if SIMDWIDTH == 8
+
+void ShadeRowSIMD(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  __m256i c, l, r, u, d, zc, dzL, dzR, dzU, dzD;
+  __m256i mL, mR, mU, mD, q0, q1, q2, q3, v0, v1, cnt, used, type, road, idx;
+  __m256i zero, byteMask;
+  __m256  fv0, fv1, fv2, dot, len, light, color, lx, ly, lz, ll;
+  __m256  shadow, amb, strength, occlusion;
+  int     rgb[3][8];
+  int     usedLane[8], cntLane[8];
+  int     x, i, j;
+
+  if ((prev == NULL) || (next == NULL)) {
+    ShadeRow(prev, row, next, y, out);
+    return;
+  }
+
+  zero = _mm256_setzero_si256();
+  byteMask = _mm256_set1_epi32(0xFF);
+  lx = _mm256_set1_ps((float)lights.lightVector[0]);
+  ly = _mm256_set1_ps((float)lights.lightVector[1]);
+  lz = _mm256_set1_ps((float)lights.lightVector[2]);
+  ll = _mm256_set1_ps((float)(lights.lightVector[0] * lights.lightVector[0] +
+      lights.lightVector[1] * lights.lightVector[1] + lights.lightVector[2] * lights.lightVector[2]));
+  amb = _mm256_set1_ps((float)lights.ambientLight);
+  strength = _mm256_set1_ps((float)(lights.shadowStrength / 255.0));
+  occlusion = _mm256_set1_ps((float)(lights.occlusionStrength / 255.0));
+
+  ShadePoint(&lights, prev, row, next, 0, y, out);
+  for (x = 1; x + SIMDWIDTH < LANDSIZE; x += SIMDWIDTH) {
+    // Each landData is one 32 bit lane: type in the low word, then z, then used
+    c = _mm256_loadu_si256((__m256i *)&row[x]);
+    l = _mm256_loadu_si256((__m256i *)&row[x - 1]);
+    r = _mm256_loadu_si256((__m256i *)&row[x + 1]);
+    u = _mm256_loadu_si256((__m256i *)&prev[x]);
+    d = _mm256_loadu_si256((__m256i *)&next[x]);
+
+    zc = _mm256_and_si256(_mm256_srli_epi32(c, 16), byteMask);
+    dzL = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(l, 16), byteMask), zc);
+    dzR = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(r, 16), byteMask), zc);
+    dzU = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(u, 16), byteMask), zc);
+    dzD = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(d, 16), byteMask), zc);
+    mL = _mm256_cmpgt_epi32(_mm256_srli_epi32(l, 24), zero);
+    mR = _mm256_cmpgt_epi32(_mm256_srli_epi32(r, 24), zero);
+    mU = _mm256_cmpgt_epi32(_mm256_srli_epi32(u, 24), zero);
+    mD = _mm256_cmpgt_epi32(_mm256_srli_epi32(d, 24), zero);
+    used = _mm256_cmpgt_epi32(_mm256_srli_epi32(c, 24), zero);
+
+    // The four corners used to build the normal, as in ShadePoint()
+    q0 = _mm256_and_si256(mR, mD);
+    q1 = _mm256_and_si256(mL, mD);
+    q2 = _mm256_and_si256(mL, mU);
+    q3 = _mm256_and_si256(mR, mU);
+    v0 = _mm256_sub_epi32(_mm256_add_epi32(_mm256_and_si256(q1, dzL), _mm256_and_si256(q2, dzL)),
+        _mm256_add_epi32(_mm256_and_si256(q0, dzR), _mm256_and_si256(q3, dzR)));
+    v1 = _mm256_sub_epi32(_mm256_add_epi32(_mm256_and_si256(q2, dzU), _mm256_and_si256(q3, dzU)),
+        _mm256_add_epi32(_mm256_and_si256(q0, dzD), _mm256_and_si256(q1, dzD)));
+    cnt = _mm256_sub_epi32(zero, _mm256_add_epi32(_mm256_add_epi32(q0, q1), _mm256_add_epi32(q2, q3)));
+
+    fv0 = _mm256_cvtepi32_ps(v0);
+    fv1 = _mm256_cvtepi32_ps(v1);
+    fv2 = _mm256_mul_ps(_mm256_cvtepi32_ps(cnt), _mm256_set1_ps(12.0f));
+    dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, fv0), _mm256_mul_ps(ly, fv1)), _mm256_mul_ps(lz, fv2));
+    len = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fv0, fv0), _mm256_mul_ps(fv1, fv1)), _mm256_mul_ps(fv2, fv2));
+    len = _mm256_sqrt_ps(_mm256_mul_ps(ll, len));
+    light = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(dot, len),
+        _mm256_set1_ps(128.0f)), _mm256_set1_ps(128.0f)), _mm256_set1_ps((float)lights.lightCorrection)),
+        _mm256_set1_ps((float)lights.ambientLight));
+
+    // Shadow takes away part of the direct light, as in ShadePoint()
+    if (shadowMask != NULL) {
+      shadow = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&shadowMask[y * LANDSIZE + x])));
+      light = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(light, amb), _mm256_sub_ps(_mm256_set1_ps(1.0f),
+          _mm256_mul_ps(shadow, strength))), amb);
+    }
+    if (occlusionMask != NULL) {
+      shadow = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&occlusionMask[y * LANDSIZE + x])));
+      light = _mm256_mul_ps(light, _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(shadow, occlusion)));
+    }
+
+    // Check for road bit(s)
+    type = _mm256_and_si256(c, _mm256_set1_epi32(0xFFFF));
+    road = _mm256_cmpgt_epi32(_mm256_and_si256(type, _mm256_set1_epi32(3)), zero);
+    idx = _mm256_srli_epi32(_mm256_and_si256(type, byteMask), 2);
+    idx = _mm256_or_si256(_mm256_andnot_si256(road, idx), _mm256_and_si256(road, _mm256_set1_epi32(32)));
+
+    for (i = 0; i < 3; i++) {
+      color = _mm256_mul_ps(_mm256_i32gather_ps(colorScale[i], idx, 4), light);
+      color = _mm256_min_ps(_mm256_max_ps(color, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+      _mm256_storeu_si256((__m256i *)rgb[i], _mm256_cvttps_epi32(color));
+    }
+    _mm256_storeu_si256((__m256i *)usedLane, used);
+    _mm256_storeu_si256((__m256i *)cntLane, cnt);
+
+    for (j = 0; j < SIMDWIDTH; j++) {
+      if (!usedLane[j]) {
+        out[(x + j) * 3] = 0;
+        out[(x + j) * 3 + 1] = 0xFF;
+        out[(x + j) * 3 + 2] = 0;
+      }
+      else if (cntLane[j] == 0) {
+        // An isolated point has no normal; the reference path ends up with 0
+        out[(x + j) * 3] = 0;
+        out[(x + j) * 3 + 1] = 0;
+        out[(x + j) * 3 + 2] = 0;
+      }
       else {
-        // If data is not present for a point on the map, the resultant pixel is green
-        topo[y][x][0] = 0;
-        topo[y][x][1] = 0xFF;
-        topo[y][x][2] = 0;
+        out[(x + j) * 3] = (uchar)rgb[0][j];
+        out[(x + j) * 3 + 1] = (uchar)rgb[1][j];
+        out[(x + j) * 3 + 2] = (uchar)rgb[2][j];
       }
     }
   }
+  for (; x < LANDSIZE; x++)
+    ShadePoint(&lights, prev, row, next, x, y, &out[x * 3]);
+}
 
-  // Write raw picture data
-  fwrite(topo, sizeof(uchar), LANDSIZE * LANDSIZE * 3, topoFile);
-  fclose(topoFile);
+#elif SIMDWIDTH == 4
 
-  return 0;
+// SSE2 has no blend or gather instructions, so masks are combined with
+// and/andnot and the color table lookups are done per lane.
+void ShadeRowSIMD(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  __m128i c, l, r, u, d, zc, dzL, dzR, dzU, dzD;
+  __m128i mL, mR, mU, mD, q0, q1, q2, q3, v0, v1, cnt, used, type, road, idx;
+  __m128i zero, byteMask;
+  __m128  fv0, fv1, fv2, dot, len, light, color, lx, ly, lz, ll;
+  __m128  shadow, amb, strength, occlusion;
+  int     rgb[3][4];
+  int     usedLane[4], cntLane[4], idxLane[4];
+  int     shadowBytes;
+  int     x, i, j;
+
+  if ((prev == NULL) || (next == NULL)) {
+    ShadeRow(prev, row, next, y, out);
+    return;
+  }
+
+  zero = _mm_setzero_si128();
+  byteMask = _mm_set1_epi32(0xFF);
+  lx = _mm_set1_ps((float)lights.lightVector[0]);
+  ly = _mm_set1_ps((float)lights.lightVector[1]);
+  lz = _mm_set1_ps((float)lights.lightVector[2]);
+  ll = _mm_set1_ps((float)(lights.lightVector[0] * lights.lightVector[0] +
+      lights.lightVector[1] * lights.lightVector[1] + lights.lightVector[2] * lights.lightVector[2]));
+  amb = _mm_set1_ps((float)lights.ambientLight);
+  strength = _mm_set1_ps((float)(lights.shadowStrength / 255.0));
+  occlusion = _mm_set1_ps((float)(lights.occlusionStrength / 255.0));
+
+  ShadePoint(&lights, prev, row, next, 0, y, out);
+  for (x = 1; x + SIMDWIDTH < LANDSIZE; x += SIMDWIDTH) {
+    // Each landData is one 32 bit lane: type in the low word, then z, then used
+    c = _mm_loadu_si128((__m128i *)&row[x]);
+    l = _mm_loadu_si128((__m128i *)&row[x - 1]);
+    r = _mm_loadu_si128((__m128i *)&row[x + 1]);
+    u = _mm_loadu_si128((__m128i *)&prev[x]);
+    d = _mm_loadu_si128((__m128i *)&next[x]);
+
+    zc = _mm_and_si128(_mm_srli_epi32(c, 16), byteMask);
+    dzL = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(l, 16), byteMask), zc);
+    dzR = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(r, 16), byteMask), zc);
+    dzU = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(u, 16), byteMask), zc);
+    dzD = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(d, 16), byteMask), zc);
+    mL = _mm_cmpgt_epi32(_mm_srli_epi32(l, 24), zero);
+    mR = _mm_cmpgt_epi32(_mm_srli_epi32(r, 24), zero);
+    mU = _mm_cmpgt_epi32(_mm_srli_epi32(u, 24), zero);
+    mD = _mm_cmpgt_epi32(_mm_srli_epi32(d, 24), zero);
+    used = _mm_cmpgt_epi32(_mm_srli_epi32(c, 24), zero);
+
+    // The four corners used to build the normal, as in ShadePoint()
+    q0 = _mm_and_si128(mR, mD);
+    q1 = _mm_and_si128(mL, mD);
+    q2 = _mm_and_si128(mL, mU);
+    q3 = _mm_and_si128(mR, mU);
+    v0 = _mm_sub_epi32(_mm_add_epi32(_mm_and_si128(q1, dzL), _mm_and_si128(q2, dzL)),
+        _mm_add_epi32(_mm_and_si128(q0, dzR), _mm_and_si128(q3, dzR)));
+    v1 = _mm_sub_epi32(_mm_add_epi32(_mm_and_si128(q2, dzU), _mm_and_si128(q3, dzU)),
+        _mm_add_epi32(_mm_and_si128(q0, dzD), _mm_and_si128(q1, dzD)));
+    cnt = _mm_sub_epi32(zero, _mm_add_epi32(_mm_add_epi32(q0, q1), _mm_add_epi32(q2, q3)));
+
+    fv0 = _mm_cvtepi32_ps(v0);
+    fv1 = _mm_cvtepi32_ps(v1);
+    fv2 = _mm_mul_ps(_mm_cvtepi32_ps(cnt), _mm_set1_ps(12.0f));
+    dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, fv0), _mm_mul_ps(ly, fv1)), _mm_mul_ps(lz, fv2));
+    len = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fv0, fv0), _mm_mul_ps(fv1, fv1)), _mm_mul_ps(fv2, fv2));
+    len = _mm_sqrt_ps(_mm_mul_ps(ll, len));
+    light = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(dot, len),
+        _mm_set1_ps(128.0f)), _mm_set1_ps(128.0f)), _mm_set1_ps((float)lights.lightCorrection)),
+        _mm_set1_ps((float)lights.ambientLight));
+
+    // Shadow takes away part of the direct light, as in ShadePoint()
+    if (shadowMask != NULL) {
+      memcpy(&shadowBytes, &shadowMask[y * LANDSIZE + x], 4);
+      shadow = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(shadowBytes), zero), zero));
+      light = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(light, amb), _mm_sub_ps(_mm_set1_ps(1.0f),
+          _mm_mul_ps(shadow, strength))), amb);
+    }
+    if (occlusionMask != NULL) {
+      memcpy(&shadowBytes, &occlusionMask[y * LANDSIZE + x], 4);
+      shadow = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(shadowBytes), zero), zero));
+      light = _mm_mul_ps(light, _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(shadow, occlusion)));
+    }
+
+    // Check for road bit(s)
+    type = _mm_and_si128(c, _mm_set1_epi32(0xFFFF));
+    road = _mm_cmpgt_epi32(_mm_and_si128(type, _mm_set1_epi32(3)), zero);
+    idx = _mm_srli_epi32(_mm_and_si128(type, byteMask), 2);
+    idx = _mm_or_si128(_mm_andnot_si128(road, idx), _mm_and_si128(road, _mm_set1_epi32(32)));
+    _mm_storeu_si128((__m128i *)idxLane, idx);
+
+    for (i = 0; i < 3; i++) {
+      color = _mm_mul_ps(_mm_setr_ps(colorScale[i][idxLane[0]], colorScale[i][idxLane[1]],
+          colorScale[i][idxLane[2]], colorScale[i][idxLane[3]]), light);
+      color = _mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+      _mm_storeu_si128((__m128i *)rgb[i], _mm_cvttps_epi32(color));
+    }
+    _mm_storeu_si128((__m128i *)usedLane, used);
+    _mm_storeu_si128((__m128i *)cntLane, cnt);
+
+    for (j = 0; j < SIMDWIDTH; j++) {
+      if (!usedLane[j]) {
+        out[(x + j) * 3] = 0;
+        out[(x + j) * 3 + 1] = 0xFF;
+        out[(x + j) * 3 + 2] = 0;
+      }
+      else if (cntLane[j] == 0) {
+        // An isolated point has no normal; the reference path ends up with 0
+        out[(x + j) * 3] = 0;
+        out[(x + j) * 3 + 1] = 0;
+        out[(x + j) * 3 + 2] = 0;
+      }
+      else {
+        out[(x + j) * 3] = (uchar)rgb[0][j];
+        out[(x + j) * 3 + 1] = (uchar)rgb[1][j];
+        out[(x + j) * 3 + 2] = (uchar)rgb[2][j];
+      }
+    }
+  }
+  for (; x < LANDSIZE; x++)
+    ShadePoint(&lights, prev, row, next, x, y, &out[x * 3]);
+}
+
+#else
+
+// No SIMD on this platform, so the reference path is used
+void ShadeRowSIMD(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  ShadeRow(prev, row, next, y, out);
+}
+
+#endif
+
+// Lookup table shading
+//
+// z is a uchar, so the normal is made of small integers: v[0] and v[1] are
+// sums of up to four height differences and v[2] is 12.0 times the number of
+// neighbour pairs that were used.  For every v[0] and v[1] within LUTRANGE and
+// every pair count, InitLUT() runs the same math as ShadePoint() for all 33
+// land types.  ShadeRowLUT() then only needs integer adds and one table lookup
+// per point, and its output matches the reference path bit for bit.  The rare
+// steeper points fall back to ShadePoint().
+
+#define LUTRANGE 31
+#define LUTSIDE  (2 * LUTRANGE + 1)
+
+// Indexed by [pair count - 1][v[1] + LUTRANGE][v[0] + LUTRANGE][type]
+uchar (*lutColor)[LUTSIDE][LUTSIDE][33][3];
+
+int InitLUT()
+{
+  int    count, v0, v1, type;
+  double v[3], light;
+
+  lutColor = (uchar (*)[LUTSIDE][LUTSIDE][33][3])malloc(4 * sizeof(*lutColor));
+  if (lutColor == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return 0;
+  }
+
+  for (count = 1; count <= 4; count++) {
+    for (v1 = -LUTRANGE; v1 <= LUTRANGE; v1++) {
+      for (v0 = -LUTRANGE; v0 <= LUTRANGE; v0++) {
+        v[0] = v0;
+        v[1] = v1;
+        v[2] = 12.0 * count;
+        light = Light(&lights, v);
+        for (type = 0; type < 33; type++)
+          ApplyLight(&lights, type, light, lutColor[count - 1][v1 + LUTRANGE][v0 + LUTRANGE][type]);
+      }
+    }
+  }
+
+  return 1;
+}
+
+void ShadeRowLUT(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  int   x, v0, v1, count;
+  uchar *color;
+
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if (!row[x].used) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    if ((count == 0) || (v0 < -LUTRANGE) || (v0 > LUTRANGE) || (v1 < -LUTRANGE) || (v1 > LUTRANGE) ||
+        ShadowAt(x, y) || OcclusionAt(x, y)) {
+      ShadePoint(&lights, prev, row, next, x, y, out);
+      continue;
+    }
+
+    color = lutColor[count - 1][v1 + LUTRANGE][v0 + LUTRANGE][LandType(&row[x])];
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+  }
+}
+
+// Multi-directional shading
+//
+// ShadeRowMulti() lights each point from every direction in lights in one
+// pass.  The normal is worked out and normalized once per point; the directions
+// are then evaluated SIMDWIDTH at a time, four to a vector, with the weights
+// folded into the direction vectors ahead of time.  It is single precision, so
+// -verify allows SIMDTOLERANCE against Light().
+
+// Normalized directions times normalized weights, padded out with zeros
+float multiX[MAXDIRECTIONS], multiY[MAXDIRECTIONS], multiZ[MAXDIRECTIONS];
+
+void InitMulti()
+{
+  double weights, len;
+  int    k;
+
+  weights = 0.0;
+  for (k = 0; k < lights.numDirections; k++)
+    weights += lights.direction[k][3];
+
+  for (k = 0; k < MAXDIRECTIONS; k++) {
+    multiX[k] = 0.0f;
+    multiY[k] = 0.0f;
+    multiZ[k] = 0.0f;
+    if (k < lights.numDirections) {
+      len = sqrt(lights.direction[k][0] * lights.direction[k][0] + lights.direction[k][1] * lights.direction[k][1] +
+          lights.direction[k][2] * lights.direction[k][2]);
+      multiX[k] = (float)(lights.direction[k][0] / len * lights.direction[k][3] / weights);
+      multiY[k] = (float)(lights.direction[k][1] / len * lights.direction[k][3] / weights);
+      multiZ[k] = (float)(lights.direction[k][2] / len * lights.direction[k][3] / weights);
+    }
+  }
 }
 
+void ShadeRowMulti(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  int   x, k, v0, v1, count;
+  float n0, n1, n2, len, sum;
+#if SIMDWIDTH > 1
+  __m128 acc, d;
+  float  lanes[4];
+#else
+  float  d;
+#endif
+
+
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if (!row[x].used) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    if (count == 0) {
+      ShadePoint(&lights, prev, row, next, x, y, out);
+      continue;
+    }
+    n0 = (float)v0;
+    n1 = (float)v1;
+    n2 = 12.0f * count;
+    len = (float)sqrt(n0 * n0 + n1 * n1 + n2 * n2);
+    n0 /= len;
+    n1 /= len;
+    n2 /= len;
+
+#if SIMDWIDTH > 1
+    acc = _mm_setzero_ps();
+    for (k = 0; k < lights.numDirections; k += 4) {
+      d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&multiX[k]), _mm_set1_ps(n0)),
+          _mm_mul_ps(_mm_loadu_ps(&multiY[k]), _mm_set1_ps(n1))), _mm_mul_ps(_mm_loadu_ps(&multiZ[k]), _mm_set1_ps(n2)));
+      acc = _mm_add_ps(acc, _mm_max_ps(d, _mm_setzero_ps()));
+    }
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    sum = 0.0f;
+    for (k = 0; k < lights.numDirections; k++) {
+      d = multiX[k] * n0 + multiY[k] * n1 + multiZ[k] * n2;
+      if (d > 0.0f)
+        sum += d;
+    }
+#endif
+
+    ApplyLight(&lights, LandType(&row[x]), Darken(&lights, sum * 256.0 * lights.lightCorrection + lights.ambientLight,
+        x, y), out);
+  }
+}
+
+// Shadows
+//
+// With the shadow setting, the sun at shadowElevation degrees casts shadows
+// away from lightVector (only its x and y are used).  ComputeShadows() sweeps
+// the map along parallel lines running away from the sun, each stepping one
+// point at a time along x or y, whichever is closer to the direction of the
+// light.  Along a line it carries the height of the shadow cast by the points
+// already passed, which drops by tan(elevation) times the distance every step;
+// a point below that height is in shadow.  Heights use the same scale as the
+// normals in ShadePoint(), 12 z units to a point.  The depth of the shadow is
+// spread over SHADOWSOFTNESS z units to soften its edges.  Every point is on
+// exactly one line, so the lines are swept on all threads, SHADOWLINES
+// neighbouring lines at a time.  Unused points cast no shadows.
+//
+// With -update, the points as far downstream of the dirty landblocks as the
+// highest shadow can fall are redrawn too (see DirtyReach()).
+
+#define SHADOWSOFTNESS 4.0f
+#define SHADOWLINES    64
+
+typedef struct {
+  int   alongY;           // 1 if the lines step along y, 0 if along x
+  int   start, step;      // Where the lines start on that axis, and which way they go
+  int   *offset;          // How far each step of a line has moved across the lines
+  int   firstLine, numLines;
+  float drop;             // How far the shadow height drops each step
+  int   nextGroup;
+} shadowJob;
+
+void SweepShadows(void *ctx)
+{
+  shadowJob *job = (shadowJob *)ctx;
+  landData  *point;
+  float     horizon, depth;
+  int       line, endLine, i, a, b, x, y;
+
+  while ((line = AtomicAdd(&job->nextGroup, 1) * SHADOWLINES) < job->numLines) {
+    endLine = (line + SHADOWLINES < job->numLines) ? line + SHADOWLINES : job->numLines;
+    for (; line < endLine; line++) {
+      horizon = -1.0e30f;
+      for (i = 0; i < LANDSIZE; i++) {
+        a = job->start + i * job->step;
+        b = job->firstLine + line + job->offset[i];
+        if ((b < 0) || (b >= LANDSIZE))
+          continue;
+        x = job->alongY ? b : a;
+        y = job->alongY ? a : b;
+
+        point = &land[y][x];
+        if (!point->used) {
+          horizon = -1.0e30f;
+          shadowMask[y * LANDSIZE + x] = 0;
+          continue;
+        }
+        horizon -= job->drop;
+        if (horizon > point->z) {
+          depth = (horizon - point->z) * (255.0f / SHADOWSOFTNESS);
+          shadowMask[y * LANDSIZE + x] = (depth >= 255.0f) ? 255 : (uchar)depth;
+        }
+        else {
+          horizon = point->z;
+          shadowMask[y * LANDSIZE + x] = 0;
+        }
+      }
+    }
+  }
+}
+
+// Builds shadowMask if the lighting has shadows.  Returns 0 if out of memory.
+int ComputeShadows()
+{
+  shadowJob job;
+  double    along, across, t;
+  int       i, minOffset, maxOffset;
+
+  // The direction the light travels in
+  along = -lights.lightVector[0];
+  across = -lights.lightVector[1];
+  if ((lights.shadowStrength <= 0.0) || ((along == 0.0) && (across == 0.0)))
+    return 1;
+
+  shadowMask = (uchar *)malloc(LANDSIZE * LANDSIZE);
+  job.offset = (int *)malloc(LANDSIZE * sizeof(int));
+  if ((shadowMask == NULL) || (job.offset == NULL)) {
+    printf("ERROR: Out of memory!\n");
+    return 0;
+  }
+
+  job.alongY = fabs(across) > fabs(along);
+  if (job.alongY) {
+    t = along;
+    along = across;
+    across = t;
+  }
+  job.step = (along > 0.0) ? 1 : -1;
+  job.start = (along > 0.0) ? 0 : LANDSIZE - 1;
+  t = across / fabs(along);
+
+  minOffset = 0;
+  maxOffset = 0;
+  for (i = 0; i < LANDSIZE; i++) {
+    job.offset[i] = (int)floor(i * t + 0.5);
+    if (job.offset[i] < minOffset)
+      minOffset = job.offset[i];
+    if (job.offset[i] > maxOffset)
+      maxOffset = job.offset[i];
+  }
+  job.firstLine = -maxOffset;
+  job.numLines = LANDSIZE + maxOffset - minOffset;
+  job.drop = (float)(sqrt(1.0 + t * t) * 12.0 * tan(lights.shadowElevation * 3.14159265358979 / 180.0));
+  job.nextGroup = 0;
+  RunJob(SweepShadows, &job);
+
+  free(job.offset);
+  return 1;
+}
+
+// Ambient occlusion
+//
+// With the occlusion setting, ComputeOcclusion() works out how much of the sky
+// each point cannot see.  It looks up to occlusionRadius points out in each of
+// occlusionDirections directions, finds the highest angle up to the horizon in
+// each, and averages the sines of those angles.  Distances use the same scale
+// as the normals in ShadePoint(), 12 z units to a point.
+//
+// A max height pyramid gives the highest point anywhere near a point.  Nothing
+// can hide the sky from a point higher than that, and a direction can stop as
+// soon as even that height, farther out, would not raise its horizon.  Rows are
+// done in bands on all threads.  Neighbouring points look at neighbouring
+// points in every direction, so with SSE2 four points are done at a time.
+// Points too close to the edge of the map for that are done one at a time.
+// With -update, the points within the radius of the dirty landblocks, whose
+// sky those can hide, are redrawn too (see DirtyReach()).
+
+#define MAXOCCLUSIONDIRECTIONS 32
+#define MAXOCCLUSIONRADIUS     64
+
+typedef struct {
+  int   numDirections;
+  int   numSteps[MAXOCCLUSIONDIRECTIONS];
+  int   dx[MAXOCCLUSIONDIRECTIONS][MAXOCCLUSIONRADIUS];
+  int   dy[MAXOCCLUSIONDIRECTIONS][MAXOCCLUSIONRADIUS];
+  float invDist[MAXOCCLUSIONDIRECTIONS][MAXOCCLUSIONRADIUS];  // 1 / distance, in z units
+  int   radius;
+  uchar *maxHeight;         // The level of the pyramid covering radius
+  int   maxShift, maxSize;  // Its points are 1 << maxShift points apart
+  int   nextBand;
+} occlusionJob;
+
+// Returns the highest point within radius of (x, y), or a little farther
+static int NearMax(occlusionJob *job, int x, int y)
+{
+  int x0, y0, x1, y1, h;
+
+  x0 = ((x >= job->radius) ? x - job->radius : 0) >> job->maxShift;
+  y0 = ((y >= job->radius) ? y - job->radius : 0) >> job->maxShift;
+  x1 = ((x + job->radius < LANDSIZE) ? x + job->radius : LANDSIZE - 1) >> job->maxShift;
+  y1 = ((y + job->radius < LANDSIZE) ? y + job->radius : LANDSIZE - 1) >> job->maxShift;
+
+  // The pyramid level is at least twice the radius, so at most 2x2 of it is needed
+  h = job->maxHeight[y0 * job->maxSize + x0];
+  if (job->maxHeight[y0 * job->maxSize + x1] > h)
+    h = job->maxHeight[y0 * job->maxSize + x1];
+  if (job->maxHeight[y1 * job->maxSize + x0] > h)
+    h = job->maxHeight[y1 * job->maxSize + x0];
+  if (job->maxHeight[y1 * job->maxSize + x1] > h)
+    h = job->maxHeight[y1 * job->maxSize + x1];
+  return h;
+}
+
+static uchar OcclusionPoint(occlusionJob *job, int x, int y)
+{
+  landData *point;
+  float    z, room, best, slope, sum;
+  int      k, i, px, py;
+
+  if (!land[y][x].used)
+    return 0;
+  z = land[y][x].z;
+  room = NearMax(job, x, y) - z;
+  if (room <= 0.0f)
+    return 0;
+
+  sum = 0.0f;
+  for (k = 0; k < job->numDirections; k++) {
+    best = 0.0f;
+    for (i = 0; (i < job->numSteps[k]) && (room * job->invDist[k][i] > best); i++) {
+      px = x + job->dx[k][i];
+      py = y + job->dy[k][i];
+      if ((px < 0) || (px >= LANDSIZE) || (py < 0) || (py >= LANDSIZE))
+        break;
+      point = &land[py][px];
+      slope = (point->z - z) * job->invDist[k][i];
+      if (point->used && (slope > best))
+        best = slope;
+    }
+    sum += best / (float)sqrt(1.0f + best * best);
+  }
+  return (uchar)(sum / job->numDirections * 255.0f + 0.5f);
+}
+
+#if SIMDWIDTH > 1
+
+// Does the four points starting at x, which are all at least radius from the
+// edge of the map
+static void OcclusionPoints(occlusionJob *job, int x, int y, uchar *out)
+{
+  __m128i c, p, zero, byteMask;
+  __m128  z, room, best, slope, sum, invDist, used;
+  int     k, i, j, lanes[4];
+
+  zero = _mm_setzero_si128();
+  byteMask = _mm_set1_epi32(0xFF);
+  c = _mm_loadu_si128((__m128i *)&land[y][x]);
+  z = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(c, 16), byteMask));
+  for (j = 0; j < 4; j++)
+    lanes[j] = NearMax(job, x + j, y);
+  room = _mm_sub_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)lanes)), z);
+  room = _mm_and_ps(room, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_srli_epi32(c, 24), zero)));
+  if (_mm_movemask_ps(_mm_cmpgt_ps(room, _mm_setzero_ps())) == 0) {
+    memset(out, 0, 4);
+    return;
+  }
+
+  sum = _mm_setzero_ps();
+  for (k = 0; k < job->numDirections; k++) {
+    best = _mm_setzero_ps();
+    for (i = 0; i < job->numSteps[k]; i++) {
+      invDist = _mm_set1_ps(job->invDist[k][i]);
+      if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_mul_ps(room, invDist), best)) == 0)
+        break;
+      p = _mm_loadu_si128((__m128i *)&land[y + job->dy[k][i]][x + job->dx[k][i]]);
+      slope = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), byteMask)), z), invDist);
+      used = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_srli_epi32(p, 24), zero));
+      best = _mm_max_ps(best, _mm_and_ps(used, slope));
+    }
+    sum = _mm_add_ps(sum, _mm_div_ps(best, _mm_sqrt_ps(_mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(best, best)))));
+  }
+
+  // Points with no room to be occluded (and unused points) were never raised
+  sum = _mm_and_ps(sum, _mm_cmpgt_ps(room, _mm_setzero_ps()));
+  _mm_storeu_si128((__m128i *)lanes, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(sum,
+      _mm_set1_ps(255.0f / job->numDirections)), _mm_set1_ps(0.5f))));
+  for (j = 0; j < 4; j++)
+    out[j] = (uchar)lanes[j];
+}
+
+#endif
+
+void OcclusionBands(void *ctx)
+{
+  occlusionJob *job = (occlusionJob *)ctx;
+  int          y, endY, x;
+
+  while ((y = AtomicAdd(&job->nextBand, 1) * BANDROWS) < LANDSIZE) {
+    endY = (y + BANDROWS < LANDSIZE) ? y + BANDROWS : LANDSIZE;
+    for (; y < endY; y++) {
+      x = 0;
+#if SIMDWIDTH > 1
+      if ((y >= job->radius) && (y < LANDSIZE - job->radius)) {
+        for (; x < job->radius; x++)
+          occlusionMask[y * LANDSIZE + x] = OcclusionPoint(job, x, y);
+        for (; x + 4 <= LANDSIZE - job->radius; x += 4)
+          OcclusionPoints(job, x, y, &occlusionMask[y * LANDSIZE + x]);
+      }
+#endif
+      for (; x < LANDSIZE; x++)
+        occlusionMask[y * LANDSIZE + x] = OcclusionPoint(job, x, y);
+    }
+  }
+}
+
+// Builds occlusionMask if the lighting has ambient occlusion.  Returns 0 if out
+// of memory.
+int ComputeOcclusion()
+{
+  occlusionJob job;
+  uchar        *level, *half;
+  int          size, halfSize, k, i, n, x, y, dx, dy;
+  double       angle;
+
+  if (lights.occlusionStrength <= 0.0)
+    return 1;
+
+  occlusionMask = (uchar *)malloc(LANDSIZE * LANDSIZE);
+  level = (uchar *)malloc(LANDSIZE * LANDSIZE);
+  if ((occlusionMask == NULL) || (level == NULL)) {
+    printf("ERROR: Out of memory!\n");
+    return 0;
+  }
+
+  // Halve the heights, keeping the highest of each 2x2, until a point of the
+  // pyramid covers at least twice the radius.  Unused points count as 0.
+  for (y = 0; y < LANDSIZE; y++) {
+    for (x = 0; x < LANDSIZE; x++)
+      level[y * LANDSIZE + x] = land[y][x].used ? land[y][x].z : 0;
+  }
+  size = LANDSIZE;
+  job.radius = lights.occlusionRadius;
+  for (job.maxShift = 0; (1 << job.maxShift) < 2 * job.radius; job.maxShift++) {
+    halfSize = (size + 1) / 2;
+    half = (uchar *)malloc(halfSize * halfSize);
+    if (half == NULL) {
+      printf("ERROR: Out of memory!\n");
+      return 0;
+    }
+    for (y = 0; y < halfSize; y++) {
+      for (x = 0; x < halfSize; x++) {
+        n = level[(2 * y) * size + 2 * x];
+        if ((2 * x + 1 < size) && (level[(2 * y) * size + 2 * x + 1] > n))
+          n = level[(2 * y) * size + 2 * x + 1];
+        if ((2 * y + 1 < size) && (level[(2 * y + 1) * size + 2 * x] > n))
+          n = level[(2 * y + 1) * size + 2 * x];
+        if ((2 * x + 1 < size) && (2 * y + 1 < size) && (level[(2 * y + 1) * size + 2 * x + 1] > n))
+          n = level[(2 * y + 1) * size + 2 * x + 1];
+        half[y * halfSize + x] = n;
+      }
+    }
+    free(level);
+    level = half;
+    size = halfSize;
+  }
+  job.maxHeight = level;
+  job.maxSize = size;
+
+  // The points to look at in each direction, leaving out repeats
+  job.numDirections = lights.occlusionDirections;
+  for (k = 0; k < job.numDirections; k++) {
+    angle = k * 2.0 * 3.14159265358979 / job.numDirections;
+    job.numSteps[k] = 0;
+    for (i = 1; i <= job.radius; i++) {
+      dx = (int)floor(i * cos(angle) + 0.5);
+      dy = (int)floor(i * sin(angle) + 0.5);
+      n = job.numSteps[k];
+      if ((n > 0) && (job.dx[k][n - 1] == dx) && (job.dy[k][n - 1] == dy))
+        continue;
+      job.dx[k][n] = dx;
+      job.dy[k][n] = dy;
+      job.invDist[k][n] = (float)(1.0 / (12.0 * sqrt((double)(dx * dx + dy * dy))));
+      job.numSteps[k]++;
+    }
+  }
+
+  job.nextBand = 0;
+  RunJob(OcclusionBands, &job);
+
+  free(level);
+  return 1;
+}
+
+// Gamma
+//
+// Colors are averaged on linear light.  gammaToLinear[] turns an sRGB value
+// into linear light from 0 to 1, and linearToGamma[] turns linear light times
+// GAMMATABLE back.
+
+#define GAMMATABLE 16384
+
+float gammaToLinear[256];
+uchar linearToGamma[GAMMATABLE + 1];
+
+void InitGamma()
+{
+  double c;
+  int    i;
+
+  for (i = 0; i < 256; i++) {
+    c = i / 255.0;
+    gammaToLinear[i] = (float)((c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+  }
+  for (i = 0; i <= GAMMATABLE; i++) {
+    c = (double)i / GAMMATABLE;
+    c = (c <= 0.0031308) ? c * 12.92 : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+    linearToGamma[i] = (uchar)(c * 255.0 + 0.5);
+  }
+}
+
+// Returns the sRGB value of linear light c
+static INLINE int LinearToGamma(float c)
+{
+  int i;
+
+  i = (int)(c * GAMMATABLE + 0.5f);
+  return linearToGamma[(i < 0) ? 0 : (i > GAMMATABLE) ? GAMMATABLE : i];
+}
+
+// Textures
+//
+// With -portal, the land types given a texture setting are drawn with that
+// texture from PORTAL.DAT instead of their landColor.  The texture is laid
+// over the map so that one copy of it covers textureSize points in each
+// direction, and every pixel samples it where it lies on the map.  The light
+// and colorCorrection are applied to the texture the same way as to landColor,
+// with the control value of the land type.
+//
+// Textures are 8 bit images with a CLUT (see acbmp.c).  Each one is decoded
+// once, into separate red, green and blue planes of linear light, and box
+// filtered down to 1x1 pixel.  A pixel samples the level where one texel is
+// about the size of the pixel, so at one pixel per point with one copy of the
+// texture per point, a land type gets the average color of its texture.
+
+#define SECSIZE       256
+#define NUMFILELOC    0x03F
+#define ROOTDIRPTRLOC 0x148
+
+#define TEXTURELEVELS 16
+
+typedef struct {
+  uint  id;
+  int   numLevels;
+  int   width[TEXTURELEVELS], height[TEXTURELEVELS];
+  float *plane[TEXTURELEVELS][3];
+} texture;
+
+texture textures[33];
+int     numTextures;
+texture *typeTexture[33];   // The texture of each land type, or NULL
+int     textureLevel[33];   // Which level of it to sample
+
+int FetchFile(FILE *inFile, uint filePos, uint len, uchar *buf)
+{
+  int  read, doChain;
+  uint sec[SECSIZE];
+
+  if (filePos == 0) {
+    printf("ERROR: NULL file pointer found!\n");
+    return 0;
+  }
+
+  doChain = 1;
+  while (doChain) {
+    read = fseek(inFile, filePos, SEEK_SET);
+    if (read != 0) {
+      printf("ERROR: Seek to %08X failed!\n", filePos);
+      return 0;
+    }
+    read = fread(sec, sizeof(uint), SECSIZE, inFile);
+    if (read != SECSIZE) {
+      printf("ERROR: Sector is only %d words!\n", read);
+      return 0;
+    }
+
+    filePos = sec[0] & 0x7FFFFFFF;
+
+    if (len > (SECSIZE - 1) * sizeof(uint)) {
+      memcpy(buf, &sec[1], (SECSIZE - 1) * sizeof(uint));
+      buf += (SECSIZE - 1) * sizeof(uint);
+      len -= (SECSIZE - 1) * sizeof(uint);
+    }
+    else {
+      memcpy(buf, &sec[1], len);
+      len = 0;
+    }
+
+    if ((filePos == 0) || (len == 0))
+      doChain = 0;
+  }
+
+  return 1;
+}
+
+int FetchFilePos(FILE *inFile, uint dirPos, uint id, uint *filePos, uint *len)
+{
+  uint dir[SECSIZE];
+  uint i;
+  uint numFiles;
+  int  read;
+
+  while (1) {
+    if (dirPos == 0) {
+      printf("ERROR: NULL directory entry found!\n");
+      return 0;
+    }
+
+    read = fseek(inFile, dirPos, SEEK_SET);
+    if (read != 0) {
+      printf("ERROR: Seek to %08X is beyond end of file!\n", dirPos);
+      return 0;
+    }
+
+    read = fread(dir, sizeof(uint), SECSIZE, inFile);
+    if (read != SECSIZE) {
+      printf("ERROR: Sector only contains %d words!\n", read);
+      return 0;
+    }
+
+    numFiles = dir[NUMFILELOC];
+    if (numFiles >= NUMFILELOC) {
+      printf("ERROR: Number of files exceeds directory entries!\n");
+      return 0;
+    }
+
+    i = 0;
+    while ((i < numFiles) && (id > dir[i * 3 + NUMFILELOC + 1])) {
+      i++;
+    }
+    if (i < numFiles) {
+      if (id == dir[i * 3 + NUMFILELOC + 1]) {
+        *filePos = dir[i * 3 + NUMFILELOC + 2];
+        *len = dir[i * 3 + NUMFILELOC + 3];
+        return 1;
+      }
+    }
+
+    if (dir[1] == 0) {
+      *filePos = 0;
+      *len = 0;
+      return 0;
+    }
+
+    dirPos = dir[i + 1];
+  }
+
+  return 0;
+}
+
+// Reads a whole file out of PORTAL.DAT.  Returns NULL if it cannot.
+uchar *ReadPortalFile(FILE *inFile, uint rootDirPtr, uint id, uint *len)
+{
+  uchar *buf;
+  uint  filePos;
+
+  if (!FetchFilePos(inFile, rootDirPtr, id, &filePos, len)) {
+    printf("ERROR: File %08X could not be found!\n", id);
+    return NULL;
+  }
+  buf = (uchar *)malloc(*len + 4);
+  if (buf == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return NULL;
+  }
+  if (!FetchFile(inFile, filePos, *len, buf)) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+// Decodes texture id into tex
+int DecodeTexture(FILE *inFile, uint rootDirPtr, uint id, texture *tex)
+{
+  uchar *buf, *pal, *image, *p;
+  uint  len, palLen, palId, header[4];
+  int   w, h, x, y, i, l, x0, x1, y0, y1;
+  float *src, *dst;
+
+  buf = ReadPortalFile(inFile, rootDirPtr, id, &len);
+  if (buf == NULL)
+    return 0;
+  memcpy(header, buf, sizeof(header));
+  w = header[2];
+  h = header[3];
+  if ((header[1] != 2) || (w <= 0) || (h <= 0) || ((uint)(w * h) + 20 > len)) {
+    printf("ERROR: File %08X is not an 8 bit texture!\n", id);
+    free(buf);
+    return 0;
+  }
+  image = buf + sizeof(header);
+  memcpy(&palId, image + w * h, sizeof(uint));
+
+  pal = ReadPortalFile(inFile, rootDirPtr, palId, &palLen);
+  if (pal == NULL) {
+    free(buf);
+    return 0;
+  }
+
+  tex->id = id;
+  tex->numLevels = 0;
+  for (l = 0; l < TEXTURELEVELS; l++) {
+    tex->width[l] = w;
+    tex->height[l] = h;
+    for (i = 0; i < 3; i++) {
+      tex->plane[l][i] = (float *)malloc(w * h * sizeof(float));
+      if (tex->plane[l][i] == NULL) {
+        printf("ERROR: Out of memory!\n");
+        free(pal);
+        free(buf);
+        return 0;
+      }
+    }
+    tex->numLevels++;
+
+    if (l == 0) {
+      // The CLUT entries are blue, green, red and a spare, after 8 bytes
+      for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+          if ((uint)image[y * w + x] * 4 + 11 > palLen) {
+            printf("ERROR: Texture %08X uses colors past the end of its CLUT!\n", id);
+            free(pal);
+            free(buf);
+            return 0;
+          }
+          p = &pal[image[y * w + x] * 4 + 8];
+          tex->plane[0][0][y * w + x] = gammaToLinear[p[2]];
+          tex->plane[0][1][y * w + x] = gammaToLinear[p[1]];
+          tex->plane[0][2][y * w + x] = gammaToLinear[p[0]];
+        }
+      }
+    }
+    else {
+      // Average each 2x2 of the level above, repeating its last row and column
+      // when it is odd
+      for (i = 0; i < 3; i++) {
+        src = tex->plane[l - 1][i];
+        dst = tex->plane[l][i];
+        for (y = 0; y < h; y++) {
+          y0 = 2 * y;
+          y1 = (2 * y + 1 < tex->height[l - 1]) ? 2 * y + 1 : y0;
+          for (x = 0; x < w; x++) {
+            x0 = 2 * x;
+            x1 = (2 * x + 1 < tex->width[l - 1]) ? 2 * x + 1 : x0;
+            dst[y * w + x] = 0.25f * (src[y0 * tex->width[l - 1] + x0] + src[y0 * tex->width[l - 1] + x1] +
+                src[y1 * tex->width[l - 1] + x0] + src[y1 * tex->width[l - 1] + x1]);
+          }
+        }
+      }
+    }
+
+    if ((w == 1) && (h == 1))
+      break;
+    w = (w > 1) ? w / 2 : 1;
+    h = (h > 1) ? h / 2 : 1;
+  }
+
+  free(pal);
+  free(buf);
+  return 1;
+}
+
+// Decodes the textures of the lighting and picks the level to sample for
+// pictures scale pixels to a point
+int LoadTextures(char *portalName, int scale)
+{
+  FILE   *inFile;
+  uint   rootDirPtr;
+  int    type, n, l;
+  double texels;
+
+  inFile = fopen(portalName, "rb");
+  if (inFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", portalName);
+    return 0;
+  }
+  if ((fseek(inFile, ROOTDIRPTRLOC, SEEK_SET) != 0) || (fread(&rootDirPtr, sizeof(uint), 1, inFile) != 1)) {
+    printf("ERROR: File %s is not a PORTAL.DAT!\n", portalName);
+    fclose(inFile);
+    return 0;
+  }
+
+  numTextures = 0;
+  for (type = 0; type < 33; type++) {
+    typeTexture[type] = NULL;
+    if (lights.texture[type] == 0)
+      continue;
+
+    // Land types that share a texture share its decoded copy
+    for (n = 0; (n < numTextures) && (textures[n].id != lights.texture[type]); n++)
+      ;
+    if (n == numTextures) {
+      if (!DecodeTexture(inFile, rootDirPtr, lights.texture[type], &textures[n])) {
+        fclose(inFile);
+        return 0;
+      }
+      numTextures++;
+    }
+    typeTexture[type] = &textures[n];
+
+    // How many texels of level 0 each pixel covers
+    texels = textures[n].width[0] / (scale * lights.textureSize);
+    for (l = 0; (l < textures[n].numLevels - 1) && (texels > 1.0); l++)
+      texels /= 2.0;
+    textureLevel[type] = l;
+  }
+  fclose(inFile);
+
+  printf("%d textures decoded.\n", numTextures);
+  return 1;
+}
+
+// Colors a pixel at (u, v) on the map, in points, with the texture of type
+static INLINE void ApplyTexture(const lighting *lt, int type, float u, float v, double light, uchar *out)
+{
+  texture *tex = typeTexture[type];
+  int     l, w, h, tx, ty, i;
+  double  color;
+
+  l = textureLevel[type];
+  w = tex->width[l];
+  h = tex->height[l];
+  u /= (float)lt->textureSize;
+  v /= (float)lt->textureSize;
+  tx = (int)((u - (float)floor(u)) * w);
+  ty = (int)((v - (float)floor(v)) * h);
+  if (tx >= w)
+    tx = w - 1;
+  if (ty >= h)
+    ty = h - 1;
+
+  for (i = 0; i < 3; i++) {
+    color = (LinearToGamma(tex->plane[l][i][ty * w + tx]) * lt->colorCorrection / lt->landColor[type][3]) *
+        light / 256.0;
+    if (color > 255.0)
+      out[i] = 255;
+    else if (color < 0.0)
+      out[i] = 0;
+    else
+      out[i] = (uchar)color;
+  }
+}
+
+// Shades one row of the map, drawing the land types that have textures with them
+void ShadeRowTextured(landData *prev, landData *row, landData *next, int y, uchar *out)
+{
+  double v[3], light;
+  int    x, v0, v1, count, type;
+
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if (!row[x].used) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = 12.0 * count;
+    light = Darken(&lights, Light(&lights, v), x, y);
+    type = LandType(&row[x]);
+    if (typeTexture[type] != NULL)
+      ApplyTexture(&lights, type, x + 0.5f, y + 0.5f, light, out);
+    else
+      ApplyLight(&lights, type, light, out);
+  }
+}
+
+// Output
+//
+// Pictures are written a band of rows at a time, so the whole picture never
+// has to be held in memory.  A file whose name ends in .png is written as a PNG,
+// anything else as the headerless RAW described at the top of this file.
+//
+// The PNG writer needs no outside libraries.  Each band is cut into chunks of
+// PNGCHUNKROWS rows which are filtered and deflated on separate threads.  Every
+// chunk is compressed on its own and ends on a byte boundary (with an empty
+// stored block), so the chunks can simply be written one after the other as
+// IDAT chunks.  The Adler-32 checksums of the chunks are combined for the end
+// of the zlib stream.  Each row gets whichever of the five PNG filters gives
+// the smallest sum of absolute differences.
+
+#define PNGCHUNKROWS BANDROWS
+
+#define WINDOWSIZE 32768
+#define HASHBITS   15
+#define MAXCHAIN   32
+#define MINMATCH   3
+#define MAXMATCH   258
+
+// Matching stops at the first match of NICEMATCH bytes, and positions inside
+// matches longer than MAXINSERT are not hashed.  Upsampled tiles are full of
+// long repeats, which would otherwise make the chains very slow to search.
+#define NICEMATCH  64
+#define MAXINSERT  32
+
+// Symbols are literals, or matches with bit 31 set, the length in bits 16-24,
+// and the distance in bits 0-15.  Each block holds at most BLOCKSYMBOLS.
+#define MATCHFLAG    0x80000000
+#define BLOCKSYMBOLS 16384
+
+typedef struct {
+  uchar *buf;
+  int   len, size;
+  uint  bits;
+  int   numBits;
+} bitWriter;
+
+typedef struct {
+  uchar     *filtered;
+  int       filteredLen;
+  uint      adler;
+  bitWriter out;
+} pngChunk;
+
+typedef struct {
+  FILE  *file;
+  int   width, height, channels;
+  int   rowsDone;
+  uint  adler;
+  uchar *prevRow;
+  int   serial;   // Set to compress on the calling thread, e.g. inside a job
+} pngWriter;
+
+typedef struct {
+  FILE      *file;
+  int       isPNG;
+  int       rowBytes;
+  pngWriter png;
+} imageWriter;
+
+uint crcTable[256];
+
+ushort lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+uchar lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+ushort distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+uchar distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+uchar codeLengthOrder[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Code for each match length 3-258 and for each (distance - 1) / 128 and
+// distance - 1 below 256
+uchar lengthCode[MAXMATCH + 1];
+uchar distCodeLow[256], distCodeHigh[256];
+
+void InitPNG()
+{
+  uint c;
+  int  i, j, code;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+    crcTable[i] = c;
+  }
+
+  for (code = 0; code < 29; code++) {
+    for (i = lengthBase[code]; (i < lengthBase[code] + (1 << lengthExtra[code])) && (i <= MAXMATCH); i++)
+      lengthCode[i] = code;
+  }
+  lengthCode[MAXMATCH] = 28;
+
+  for (code = 0; code < 30; code++) {
+    for (i = distBase[code] - 1; i < distBase[code] - 1 + (1 << distExtra[code]); i++) {
+      if (i < 256)
+        distCodeLow[i] = code;
+      else
+        distCodeHigh[i >> 7] = code;
+    }
+  }
+}
+
+uint Crc(uint crc, uchar *buf, int len)
+{
+  int i;
+
+  crc = ~crc;
+  for (i = 0; i < len; i++)
+    crc = crcTable[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint Adler(uint adler, uchar *buf, int len)
+{
+  uint a, b;
+  int  n;
+
+  a = adler & 0xFFFF;
+  b = adler >> 16;
+  while (len > 0) {
+    // 5552 is the most bytes that can be summed before b can overflow
+    n = (len < 5552) ? len : 5552;
+    len -= n;
+    while (n--) {
+      a += *buf++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return a | (b << 16);
+}
+
+// Returns the Adler-32 of two buffers back to back, given the Adler-32 of
+// each and the length of the second
+uint AdlerCombine(uint adler1, uint adler2, int len2)
+{
+  uint rem, sum1, sum2;
+
+  rem = len2 % 65521;
+  sum1 = adler1 & 0xFFFF;
+  sum2 = (rem * sum1) % 65521;
+  sum1 += (adler2 & 0xFFFF) + 65521 - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + 65521 - rem;
+  if (sum1 >= 65521)
+    sum1 -= 65521;
+  if (sum1 >= 65521)
+    sum1 -= 65521;
+  if (sum2 >= 65521 * 2)
+    sum2 -= 65521 * 2;
+  if (sum2 >= 65521)
+    sum2 -= 65521;
+  return sum1 | (sum2 << 16);
+}
+
+void PutBits(bitWriter *bw, uint value, int numBits)
+{
+  bw->bits |= value << bw->numBits;
+  bw->numBits += numBits;
+  while (bw->numBits >= 8) {
+    if (bw->len == bw->size) {
+      bw->size = bw->size * 2 + 4096;
+      bw->buf = (uchar *)realloc(bw->buf, bw->size);
+    }
+    bw->buf[bw->len++] = (uchar)bw->bits;
+    bw->bits >>= 8;
+    bw->numBits -= 8;
+  }
+}
+
+// Writes an empty stored block, which pads the stream out to a byte boundary
+void AlignBits(bitWriter *bw)
+{
+  PutBits(bw, 0, 3);
+  if (bw->numBits > 0)
+    PutBits(bw, 0, 8 - bw->numBits);
+  PutBits(bw, 0x0000, 16);
+  PutBits(bw, 0xFFFF, 16);
+}
+
+int CompareFreq(const void *a, const void *b)
+{
+  const uint *fa = (const uint *)a;
+  const uint *fb = (const uint *)b;
+
+  if (fa[0] != fb[0])
+    return (fa[0] < fb[0]) ? -1 : 1;
+  return (int)fa[1] - (int)fb[1];
+}
+
+// Builds Huffman code lengths of at most maxLen bits for the n symbols with
+// the given frequencies.  If the tree comes out too deep, the frequencies are
+// flattened and the tree is built again.
+void BuildLengths(uint *freq, int n, int maxLen, uchar *len)
+{
+  uint leaf[288][2];
+  uint weight[576];
+  int  parent[576];
+  int  depth[576];
+  int  numLeaves, numNodes;
+  int  i, j, k, pick, tooDeep;
+  uint scaled[288];
+
+  for (i = 0; i < n; i++)
+    scaled[i] = freq[i];
+
+  do {
+    memset(len, 0, n);
+    numLeaves = 0;
+    for (i = 0; i < n; i++) {
+      if (scaled[i] > 0) {
+        leaf[numLeaves][0] = scaled[i];
+        leaf[numLeaves][1] = i;
+        numLeaves++;
+      }
+    }
+
+    // A code needs at least two symbols to be complete
+    if (numLeaves == 0) {
+      len[0] = 1;
+      len[1] = 1;
+      return;
+    }
+    if (numLeaves == 1) {
+      len[leaf[0][1]] = 1;
+      len[(leaf[0][1] == 0) ? 1 : 0] = 1;
+      return;
+    }
+
+    qsort(leaf, numLeaves, sizeof(leaf[0]), CompareFreq);
+    for (i = 0; i < numLeaves; i++)
+      weight[i] = leaf[i][0];
+
+    // Two queue construction: leaves in order, then internal nodes in order
+    i = 0;
+    j = numLeaves;
+    numNodes = numLeaves;
+    while (numNodes < 2 * numLeaves - 1) {
+      weight[numNodes] = 0;
+      for (k = 0; k < 2; k++) {
+        if ((i < numLeaves) && ((j >= numNodes) || (weight[i] <= weight[j])))
+          pick = i++;
+        else
+          pick = j++;
+        weight[numNodes] += weight[pick];
+        parent[pick] = numNodes;
+      }
+      numNodes++;
+    }
+
+    depth[numNodes - 1] = 0;
+    tooDeep = 0;
+    for (i = numNodes - 2; i >= 0; i--) {
+      depth[i] = depth[parent[i]] + 1;
+      if ((i < numLeaves) && (depth[i] > maxLen))
+        tooDeep = 1;
+    }
+
+    if (tooDeep) {
+      for (i = 0; i < n; i++) {
+        if (scaled[i] > 0)
+          scaled[i] = (scaled[i] >> 1) + 1;
+      }
+    }
+  } while (tooDeep);
+
+  for (i = 0; i < numLeaves; i++)
+    len[leaf[i][1]] = depth[i];
+}
+
+// Assigns canonical codes to the lengths, bit reversed since deflate sends
+// Huffman codes most significant bit first
+void BuildCodes(uchar *len, int n, ushort *code)
+{
+  int  count[16], next[16];
+  int  i, j, c;
+
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++)
+    count[len[i]]++;
+  count[0] = 0;
+  c = 0;
+  for (i = 1; i < 16; i++) {
+    c = (c + count[i - 1]) << 1;
+    next[i] = c;
+  }
+  for (i = 0; i < n; i++) {
+    if (len[i] > 0) {
+      c = next[len[i]]++;
+      code[i] = 0;
+      for (j = 0; j < len[i]; j++)
+        code[i] |= ((c >> j) & 1) << (len[i] - 1 - j);
+    }
+  }
+}
+
+// Writes one non-final block with dynamic Huffman codes
+void WriteBlock(bitWriter *bw, uint *sym, int numSym)
+{
+  uint   litFreq[286], distFreq[30], clFreq[19];
+  uchar  litLen[286], distLen[30], clLen[19];
+  ushort litCode[286], distCode[30], clCode[19];
+  uchar  lens[316];
+  uchar  rle[316][2];
+  int    numRLE;
+  int    numLit, numDist, numCL, numLens;
+  int    i, run, len, dist, code;
+
+  memset(litFreq, 0, sizeof(litFreq));
+  memset(distFreq, 0, sizeof(distFreq));
+  for (i = 0; i < numSym; i++) {
+    if (sym[i] & MATCHFLAG) {
+      len = (sym[i] >> 16) & 0x1FF;
+      dist = sym[i] & 0xFFFF;
+      litFreq[257 + lengthCode[len]]++;
+      distFreq[(dist <= 256) ? distCodeLow[dist - 1] : distCodeHigh[(dist - 1) >> 7]]++;
+    }
+    else
+      litFreq[sym[i]]++;
+  }
+  litFreq[256] = 1;
+
+  BuildLengths(litFreq, 286, 15, litLen);
+  BuildLengths(distFreq, 30, 15, distLen);
+  BuildCodes(litLen, 286, litCode);
+  BuildCodes(distLen, 30, distCode);
+
+  numLit = 286;
+  while (litLen[numLit - 1] == 0)
+    numLit--;
+  numDist = 30;
+  while ((numDist > 1) && (distLen[numDist - 1] == 0))
+    numDist--;
+
+  // Run length encode the code lengths with symbols 16, 17 and 18
+  memcpy(lens, litLen, numLit);
+  memcpy(&lens[numLit], distLen, numDist);
+  numLens = numLit + numDist;
+  numRLE = 0;
+  memset(clFreq, 0, sizeof(clFreq));
+  for (i = 0; i < numLens; i += run) {
+    run = 1;
+    while ((i + run < numLens) && (lens[i + run] == lens[i]))
+      run++;
+    if ((lens[i] == 0) && (run >= 3)) {
+      if (run > 138)
+        run = 138;
+      rle[numRLE][0] = (run >= 11) ? 18 : 17;
+      rle[numRLE][1] = run;
+    }
+    else if ((lens[i] != 0) && (i > 0) && (lens[i - 1] == lens[i]) && (run >= 3)) {
+      if (run > 6)
+        run = 6;
+      rle[numRLE][0] = 16;
+      rle[numRLE][1] = run;
+    }
+    else {
+      run = 1;
+      rle[numRLE][0] = lens[i];
+      rle[numRLE][1] = 0;
+    }
+    clFreq[rle[numRLE][0]]++;
+    numRLE++;
+  }
+
+  BuildLengths(clFreq, 19, 7, clLen);
+  BuildCodes(clLen, 19, clCode);
+  numCL = 19;
+  while ((numCL > 4) && (clLen[codeLengthOrder[numCL - 1]] == 0))
+    numCL--;
+
+  // Block header
+  PutBits(bw, 0, 1);
+  PutBits(bw, 2, 2);
+  PutBits(bw, numLit - 257, 5);
+  PutBits(bw, numDist - 1, 5);
+  PutBits(bw, numCL - 4, 4);
+  for (i = 0; i < numCL; i++)
+    PutBits(bw, clLen[codeLengthOrder[i]], 3);
+  for (i = 0; i < numRLE; i++) {
+    PutBits(bw, clCode[rle[i][0]], clLen[rle[i][0]]);
+    if (rle[i][0] == 16)
+      PutBits(bw, rle[i][1] - 3, 2);
+    else if (rle[i][0] == 17)
+      PutBits(bw, rle[i][1] - 3, 3);
+    else if (rle[i][0] == 18)
+      PutBits(bw, rle[i][1] - 11, 7);
+  }
+
+  // Block data
+  for (i = 0; i < numSym; i++) {
+    if (sym[i] & MATCHFLAG) {
+      len = (sym[i] >> 16) & 0x1FF;
+      dist = sym[i] & 0xFFFF;
+      code = lengthCode[len];
+      PutBits(bw, litCode[257 + code], litLen[257 + code]);
+      PutBits(bw, len - lengthBase[code], lengthExtra[code]);
+      code = (dist <= 256) ? distCodeLow[dist - 1] : distCodeHigh[(dist - 1) >> 7];
+      PutBits(bw, distCode[code], distLen[code]);
+      PutBits(bw, dist - distBase[code], distExtra[code]);
+    }
+    else
+      PutBits(bw, litCode[sym[i]], litLen[sym[i]]);
+  }
+  PutBits(bw, litCode[256], litLen[256]);
+}
+
+// Compresses buf into non-final deflate blocks, finishing on a byte boundary.
+// Matches are found with hash chains and are only looked for within buf.
+void Deflate(uchar *buf, int len, bitWriter *bw)
+{
+  int  *head, *prev;
+  uint *sym;
+  int  numSym;
+  int  pos, cand, chain, bestLen, bestDist, matchLen, maxLen, i;
+  uint hash;
+
+  head = (int *)malloc(sizeof(int) << HASHBITS);
+  prev = (int *)malloc(sizeof(int) * WINDOWSIZE);
+  sym = (uint *)malloc(sizeof(uint) * BLOCKSYMBOLS);
+  for (i = 0; i < (1 << HASHBITS); i++)
+    head[i] = -1;
+
+  numSym = 0;
+  pos = 0;
+  while (pos < len) {
+    bestLen = 0;
+    bestDist = 0;
+    if (pos + MINMATCH <= len) {
+      hash = ((buf[pos] << 10) ^ (buf[pos + 1] << 5) ^ buf[pos + 2]) & ((1 << HASHBITS) - 1);
+      maxLen = (len - pos < MAXMATCH) ? len - pos : MAXMATCH;
+      cand = head[hash];
+      chain = MAXCHAIN;
+      while ((cand >= 0) && (pos - cand <= WINDOWSIZE) && (chain-- > 0)) {
+        if (buf[cand + bestLen] == buf[pos + bestLen]) {
+          matchLen = 0;
+          while ((matchLen < maxLen) && (buf[cand + matchLen] == buf[pos + matchLen]))
+            matchLen++;
+          if (matchLen > bestLen) {
+            bestLen = matchLen;
+            bestDist = pos - cand;
+            if ((matchLen == maxLen) || (matchLen >= NICEMATCH))
+              break;
+          }
+        }
+        cand = prev[cand & (WINDOWSIZE - 1)];
+      }
+      prev[pos & (WINDOWSIZE - 1)] = head[hash];
+      head[hash] = pos;
+    }
+
+    if (bestLen >= MINMATCH) {
+      sym[numSym++] = MATCHFLAG | (bestLen << 16) | bestDist;
+      // Hash the positions inside the match too, so later matches can find them
+      for (i = 1; (i < bestLen) && (bestLen <= MAXINSERT); i++) {
+        if (pos + i + MINMATCH <= len) {
+          hash = ((buf[pos + i] << 10) ^ (buf[pos + i + 1] << 5) ^ buf[pos + i + 2]) & ((1 << HASHBITS) - 1);
+          prev[(pos + i) & (WINDOWSIZE - 1)] = head[hash];
+          head[hash] = pos + i;
+        }
+      }
+      pos += bestLen;
+    }
+    else
+      sym[numSym++] = buf[pos++];
+
+    if (numSym == BLOCKSYMBOLS) {
+      WriteBlock(bw, sym, numSym);
+      numSym = 0;
+    }
+  }
+  if (numSym > 0)
+    WriteBlock(bw, sym, numSym);
+  AlignBits(bw);
+
+  free(sym);
+  free(prev);
+  free(head);
+}
+
+int Paeth(int a, int b, int c)
+{
+  int p, pa, pb, pc;
+
+  p = a + b - c;
+  pa = abs(p - a);
+  pb = abs(p - b);
+  pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc))
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+// Filters row into out (filter type byte first) with whichever filter gives the
+// smallest sum of absolute values.  prev is the row above, or NULL for the
+// first row, where only None and Sub are worth trying.  scratch must hold one
+// row.
+void FilterRow(uchar *row, uchar *prev, int rowBytes, int bpp, uchar *out, uchar *scratch)
+{
+  int  filter, numFilters, i;
+  long sum, bestSum;
+
+  numFilters = (prev != NULL) ? 5 : 2;
+  bestSum = -1;
+  for (filter = 0; filter < numFilters; filter++) {
+    switch (filter) {
+      case 0:
+        memcpy(scratch, row, rowBytes);
+        break;
+      case 1:
+        for (i = 0; i < bpp; i++)
+          scratch[i] = row[i];
+        for (; i < rowBytes; i++)
+          scratch[i] = row[i] - row[i - bpp];
+        break;
+      case 2:
+        for (i = 0; i < rowBytes; i++)
+          scratch[i] = row[i] - prev[i];
+        break;
+      case 3:
+        for (i = 0; i < bpp; i++)
+          scratch[i] = row[i] - (prev[i] >> 1);
+        for (; i < rowBytes; i++)
+          scratch[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        break;
+      case 4:
+        for (i = 0; i < bpp; i++)
+          scratch[i] = row[i] - prev[i];
+        for (; i < rowBytes; i++)
+          scratch[i] = row[i] - Paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    }
+
+    sum = 0;
+    for (i = 0; i < rowBytes; i++)
+      sum += (scratch[i] < 128) ? scratch[i] : 256 - scratch[i];
+    if ((bestSum < 0) || (sum < bestSum)) {
+      bestSum = sum;
+      out[0] = filter;
+      memcpy(&out[1], scratch, rowBytes);
+    }
+  }
+}
+
+typedef struct {
+  pngWriter *png;
+  uchar     *rows;
+  int       numRows;
+  pngChunk  *chunks;
+  int       nextChunk;
+} pngJob;
+
+void CompressChunks(void *ctx)
+{
+  pngJob   *job = (pngJob *)ctx;
+  pngChunk *chunk;
+  int      rowBytes, numChunks, n, y, endY, i;
+  uchar    *prev, *scratch;
+  uchar    type[4] = {'I', 'D', 'A', 'T'};
+
+  rowBytes = job->png->width * job->png->channels;
+  numChunks = (job->numRows + PNGCHUNKROWS - 1) / PNGCHUNKROWS;
+  scratch = (uchar *)malloc(rowBytes);
+  while ((n = AtomicAdd(&job->nextChunk, 1)) < numChunks) {
+    chunk = &job->chunks[n];
+    endY = (n + 1) * PNGCHUNKROWS;
+    if (endY > job->numRows)
+      endY = job->numRows;
+
+    chunk->filteredLen = (endY - n * PNGCHUNKROWS) * (rowBytes + 1);
+    chunk->filtered = (uchar *)malloc(chunk->filteredLen);
+    for (y = n * PNGCHUNKROWS; y < endY; y++) {
+      prev = (y > 0) ? &job->rows[(y - 1) * rowBytes] : job->png->prevRow;
+      FilterRow(&job->rows[y * rowBytes], prev, rowBytes, job->png->channels,
+          &chunk->filtered[(y - n * PNGCHUNKROWS) * (rowBytes + 1)], scratch);
+    }
+    chunk->adler = Adler(1, chunk->filtered, chunk->filteredLen);
+
+    // Leave room for the IDAT length and type, filled in when written
+    memset(&chunk->out, 0, sizeof(chunk->out));
+    for (i = 0; i < 8; i++)
+      PutBits(&chunk->out, (i < 4) ? 0 : type[i - 4], 8);
+    Deflate(chunk->filtered, chunk->filteredLen, &chunk->out);
+    free(chunk->filtered);
+  }
+  free(scratch);
+}
+
+void PutBigEndian(uchar *buf, uint value)
+{
+  buf[0] = (uchar)(value >> 24);
+  buf[1] = (uchar)(value >> 16);
+  buf[2] = (uchar)(value >> 8);
+  buf[3] = (uchar)value;
+}
+
+// Writes a PNG chunk.  buf holds 4 spare bytes, the chunk type, then len bytes
+// of data.
+void WritePNGChunk(FILE *file, uchar *buf, int len)
+{
+  uchar crc[4];
+
+  PutBigEndian(buf, len);
+  PutBigEndian(crc, Crc(0, &buf[4], len + 4));
+  fwrite(buf, 1, len + 8, file);
+  fwrite(crc, 1, 4, file);
+}
+
+// Starts a PNG.  If palette is not NULL, the picture is one channel of indices
+// into its numColors colors of red, green and blue.
+void PNGBegin(pngWriter *png, FILE *file, int width, int height, int channels, uchar *palette, int numColors)
+{
+  uchar signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+  uchar ihdr[21] = {0, 0, 0, 0, 'I', 'H', 'D', 'R'};
+  uchar idat[10] = {0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x78, 0x01};
+  uchar plte[8 + 256 * 3] = {0, 0, 0, 0, 'P', 'L', 'T', 'E'};
+
+  png->file = file;
+  png->width = width;
+  png->height = height;
+  png->channels = channels;
+  png->rowsDone = 0;
+  png->adler = 1;
+  png->prevRow = NULL;
+  png->serial = 0;
+
+  fwrite(signature, 1, 8, file);
+  PutBigEndian(&ihdr[8], width);
+  PutBigEndian(&ihdr[12], height);
+  ihdr[16] = 8;
+  ihdr[17] = (palette != NULL) ? 3 : ((channels == 3) ? 2 : 0);
+  ihdr[18] = 0;
+  ihdr[19] = 0;
+  ihdr[20] = 0;
+  WritePNGChunk(file, ihdr, 13);
+  if (palette != NULL) {
+    memcpy(&plte[8], palette, numColors * 3);
+    WritePNGChunk(file, plte, numColors * 3);
+  }
+
+  // The zlib header goes in an IDAT of its own
+  WritePNGChunk(file, idat, 2);
+}
+
+void PNGWriteRows(pngWriter *png, uchar *rows, int numRows)
+{
+  pngJob job;
+  int    numChunks, n, rowBytes;
+
+  rowBytes = png->width * png->channels;
+  numChunks = (numRows + PNGCHUNKROWS - 1) / PNGCHUNKROWS;
+  job.png = png;
+  job.rows = rows;
+  job.numRows = numRows;
+  job.chunks = (pngChunk *)malloc(numChunks * sizeof(pngChunk));
+  job.nextChunk = 0;
+  if (png->serial)
+    CompressChunks(&job);
+  else
+    RunJob(CompressChunks, &job);
+
+  for (n = 0; n < numChunks; n++) {
+    WritePNGChunk(png->file, job.chunks[n].out.buf, job.chunks[n].out.len - 8);
+    png->adler = AdlerCombine(png->adler, job.chunks[n].adler, job.chunks[n].filteredLen);
+    free(job.chunks[n].out.buf);
+  }
+  free(job.chunks);
+
+  if (png->prevRow == NULL)
+    png->prevRow = (uchar *)malloc(rowBytes);
+  memcpy(png->prevRow, &rows[(numRows - 1) * rowBytes], rowBytes);
+  png->rowsDone += numRows;
+}
+
+void PNGEnd(pngWriter *png)
+{
+  // A final empty block with fixed codes, then the Adler-32
+  uchar idat[14] = {0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x03, 0x00};
+  uchar iend[8] = {0, 0, 0, 0, 'I', 'E', 'N', 'D'};
+
+  PutBigEndian(&idat[10], png->adler);
+  WritePNGChunk(png->file, idat, 6);
+  WritePNGChunk(png->file, iend, 0);
+  free(png->prevRow);
+}
+
+int IsPNG(char *fileName)
+{
+  int len;
+
+  len = strlen(fileName);
+  return (len > 4) && (!strcmp(&fileName[len - 4], ".png") || !strcmp(&fileName[len - 4], ".PNG"));
+}
+
+// Opens a picture of one channel of indices into palette (see PNGBegin()).  A
+// RAW picture is just the indices.
+int ImageOpenIndexed(imageWriter *image, char *fileName, int width, int height, uchar *palette, int numColors)
+{
+  image->file = fopen(fileName, "wb");
+  if (image->file == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+
+  image->isPNG = IsPNG(fileName);
+  image->rowBytes = width;
+  if (image->isPNG)
+    PNGBegin(&image->png, image->file, width, height, 1, palette, numColors);
+  return 1;
+}
+
+int ImageOpen(imageWriter *image, char *fileName, int width, int height, int channels)
+{
+  image->file = fopen(fileName, "wb");
+  if (image->file == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+
+  image->isPNG = IsPNG(fileName);
+  image->rowBytes = width * channels;
+  if (image->isPNG)
+    PNGBegin(&image->png, image->file, width, height, channels, NULL, 0);
+  return 1;
+}
+
+void ImageWriteRows(imageWriter *image, uchar *rows, int numRows)
+{
+  if (image->isPNG)
+    PNGWriteRows(&image->png, rows, numRows);
+  else
+    fwrite(rows, 1, image->rowBytes * numRows, image->file);
+}
+
+void ImageClose(imageWriter *image)
+{
+  if (image->isPNG)
+    PNGEnd(&image->png);
+  fclose(image->file);
+}
+
+// Vegetation
+//
+// Bits 8-15 of a point's type seem to describe its vegetation (see mapac.c).
+// graphac reads bits 11-15 as the vegetation class and bits 8-10 as its
+// density.  -vegetation writes them out as a one channel picture, with the
+// class in the top five bits and the density in the bottom three, which is
+// simply the top byte of the type; unused points are 0.  The vegetation
+// setting tints each point with a class other than 0 towards a color picked
+// for its class.  Both are done right after each row is shaded, while the row
+// of land is still in the cache, rather than in a second pass over the map.
+
+uchar vegetationColor[32][3];
+
+// Picks a color for each class, spread around the color wheel
+void InitVegetation()
+{
+  double h, f, c[3];
+  int    n, i;
+
+  for (n = 0; n < 32; n++) {
+    h = ((n * 11) % 32) / 32.0 * 6.0;
+    i = (int)h;
+    f = h - i;
+    c[0] = (i == 0 || i == 5) ? 1.0 : (i == 1) ? 1.0 - f : (i == 4) ? f : 0.0;
+    c[1] = (i == 1 || i == 2) ? 1.0 : (i == 0) ? f : (i == 3) ? 1.0 - f : 0.0;
+    c[2] = (i == 3 || i == 4) ? 1.0 : (i == 2) ? f : (i == 5) ? 1.0 - f : 0.0;
+    for (i = 0; i < 3; i++)
+      vegetationColor[n][i] = (uchar)(40.0 + 180.0 * c[i]);
+  }
+}
+
+static INLINE int VegetationClass(landData *point)
+{
+  return point->type >> 11;
+}
+
+static INLINE int VegetationDensity(landData *point)
+{
+  return (point->type >> 8) & 0x07;
+}
+
+// Tints the first width points of a shaded row with the vegetation, and if veg
+// is not NULL also writes their vegetation into it
+void VegetationRow(landData *row, uchar *out, uchar *veg, int width)
+{
+  int x, i, n, a;
+
+  if (veg != NULL) {
+    for (x = 0; x < width; x++)
+      veg[x] = row[x].used ? (uchar)(VegetationClass(&row[x]) << 3 | VegetationDensity(&row[x])) : 0;
+  }
+
+  if (lights.vegetationStrength <= 0.0)
+    return;
+  a = (int)(lights.vegetationStrength * 256.0 + 0.5);
+  for (x = 0; x < width; x++, out += 3) {
+    n = VegetationClass(&row[x]);
+    if (!row[x].used || (n == 0))
+      continue;
+    for (i = 0; i < 3; i++)
+      out[i] = (uchar)((out[i] * (256 - a) + vegetationColor[n][i] * a) >> 8);
+  }
+}
+
+// Objects
+//
+// -objects draws the objects and buildings that mapac found in the object
+// blocks (see mapac.c) over the map: each object is a small yellow square, and
+// each building a bigger red one with a dark edge.  The objects are sorted into
+// bins of OBJECTBIN points square as they are read.  Anything that draws them
+// only looks at the bins near the pixels it is drawing, so parts of the map
+// without objects cost next to nothing.  The picture draws them over each band
+// of rows as soon as it is shaded, on the band's own thread; tiles draw them
+// over each tile, from OBJECTMINZOOM on, so they stay the same size at every
+// zoom.  Only the pixels being drawn are touched, so a square across two bands
+// or tiles is simply drawn by both.
+
+#define OBJECTBIN     32
+#define OBJECTBINS    ((LANDSIZE + OBJECTBIN - 1) / OBJECTBIN)
+#define OBJECTRADIUS  2
+#define OBJECTMINZOOM TILEZOOM
+
+typedef struct {
+  uint  block;     // Landblock id of the object block (xxyyFFFE)
+  uint  id;        // Model id in PORTAL.DAT
+  float x, y, z;   // Position within the landblock
+  uint  building;  // 1 for a building, 0 for any other object
+} objectData;
+
+typedef struct {
+  float x, y;      // Position in points
+  int   building;
+} objectMark;
+
+objectMark *marks;
+int        numMarks;
+int        binStart[OBJECTBINS * OBJECTBINS + 1];
+
+uchar objectColor[2][2][3] = {
+  {{255, 224, 64}, {255, 224, 64}},
+  {{208, 32, 32}, {48, 16, 16}}
+};
+
+static INLINE int ObjectBin(float p)
+{
+  int b = (int)floor(p / OBJECTBIN);
+
+  return (b < 0) ? 0 : (b >= OBJECTBINS) ? OBJECTBINS - 1 : b;
+}
+
+// Reads the object file and sorts the objects into bins.  Objects off the map
+// are dropped.
+int LoadObjects(char *fileName)
+{
+  FILE       *objFile;
+  objectData *obj;
+  objectMark mark;
+  long       size;
+  int        numObj, i, b, *count;
+
+  objFile = fopen(fileName, "rb");
+  if (objFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+  fseek(objFile, 0, SEEK_END);
+  size = ftell(objFile);
+  fseek(objFile, 0, SEEK_SET);
+  numObj = (int)(size / sizeof(objectData));
+  obj = (objectData *)malloc((numObj + 1) * sizeof(objectData));
+  marks = (objectMark *)malloc((numObj + 1) * sizeof(objectMark));
+  count = (int *)calloc(OBJECTBINS * OBJECTBINS, sizeof(int));
+  if ((obj == NULL) || (marks == NULL) || (count == NULL)) {
+    printf("ERROR: Out of memory!\n");
+    fclose(objFile);
+    return 0;
+  }
+  numObj = (int)fread(obj, sizeof(objectData), numObj, objFile);
+  fclose(objFile);
+
+  // Count the objects in each bin, then place them
+  for (i = 0; i < numObj; i++) {
+    obj[i].x = (obj[i].block >> 24) * 8 + obj[i].x / 24.0f;
+    obj[i].y = LANDSIZE - 1 - (((obj[i].block >> 16) & 0xFF) * 8 + obj[i].y / 24.0f);
+    if (!(obj[i].x >= -0.5f) || !(obj[i].x < LANDSIZE - 0.5f) ||
+        !(obj[i].y >= -0.5f) || !(obj[i].y < LANDSIZE - 0.5f)) {
+      obj[i].block = 0xFFFFFFFF;
+      continue;
+    }
+    count[ObjectBin(obj[i].y) * OBJECTBINS + ObjectBin(obj[i].x)]++;
+  }
+  binStart[0] = 0;
+  for (b = 0; b < OBJECTBINS * OBJECTBINS; b++) {
+    binStart[b + 1] = binStart[b] + count[b];
+    count[b] = binStart[b];
+  }
+  numMarks = binStart[OBJECTBINS * OBJECTBINS];
+  for (i = 0; i < numObj; i++) {
+    if (obj[i].block == 0xFFFFFFFF)
+      continue;
+    mark.x = obj[i].x;
+    mark.y = obj[i].y;
+    mark.building = (obj[i].building != 0);
+    marks[count[ObjectBin(mark.y) * OBJECTBINS + ObjectBin(mark.x)]++] = mark;
+  }
+
+  free(obj);
+  free(count);
+  printf("Objects: %d\n", numMarks);
+  return 1;
+}
+
+// Draws the objects over out, which holds the pixels from (outX, outY) on,
+// stride pixels to a row, at s pixels to a point.  Only the pixels from x0 to
+// x1 and y0 to y1, not including x1 and y1, are touched.  Buildings are drawn
+// after the other objects so that they end up on top.
+void DrawObjects(uchar *out, int stride, int outX, int outY, int x0, int y0, int x1, int y1, float s)
+{
+  objectMark *m;
+  uchar      *c;
+  int        bx0, by0, bx1, by1, bx, by, building, r, cx, cy, x, y, i;
+
+  if (numMarks == 0)
+    return;
+
+  // The bins of objects whose squares could reach the pixels
+  bx0 = ObjectBin((x0 - OBJECTRADIUS) / s - 0.5f);
+  by0 = ObjectBin((y0 - OBJECTRADIUS) / s - 0.5f);
+  bx1 = ObjectBin((x1 + OBJECTRADIUS) / s - 0.5f);
+  by1 = ObjectBin((y1 + OBJECTRADIUS) / s - 0.5f);
+
+  for (building = 0; building < 2; building++) {
+    r = building ? OBJECTRADIUS : 1;
+    for (by = by0; by <= by1; by++) {
+      for (bx = bx0; bx <= bx1; bx++) {
+        for (i = binStart[by * OBJECTBINS + bx]; i < binStart[by * OBJECTBINS + bx + 1]; i++) {
+          m = &marks[i];
+          if (m->building != building)
+            continue;
+          cx = (int)floor((m->x + 0.5f) * s);
+          cy = (int)floor((m->y + 0.5f) * s);
+          if ((cx + r < x0) || (cx - r >= x1) || (cy + r < y0) || (cy - r >= y1))
+            continue;
+          for (y = (cy - r < y0) ? y0 : cy - r; (y <= cy + r) && (y < y1); y++) {
+            for (x = (cx - r < x0) ? x0 : cx - r; (x <= cx + r) && (x < x1); x++) {
+              c = objectColor[building][(abs(x - cx) == r) || (abs(y - cy) == r)];
+              memcpy(&out[((y - outY) * stride + x - outX) * 3], c, 3);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+typedef void (*shadeFunc)(landData *prev, landData *row, landData *next, int y, uchar *out);
+
+typedef struct {
+  shadeFunc shade;
+  uchar     *out, *veg;
+  int       firstY, endY;
+  int       objects;
+  int       nextBand;
+} shadeJob;
+
+void ShadeBands(void *ctx)
+{
+  shadeJob *job = (shadeJob *)ctx;
+  int      band, y, firstY, endY;
+
+  while ((firstY = job->firstY + (band = AtomicAdd(&job->nextBand, 1)) * BANDROWS) < job->endY) {
+    endY = firstY + BANDROWS;
+    if (endY > job->endY)
+      endY = job->endY;
+    for (y = firstY; y < endY; y++) {
+      job->shade((y > 0) ? land[y - 1] : NULL, land[y], (y < LANDSIZE - 1) ? land[y + 1] : NULL, y,
+          &job->out[(y - job->firstY) * LANDSIZE * 3]);
+      if ((job->veg != NULL) || (lights.vegetationStrength > 0.0))
+        VegetationRow(land[y], &job->out[(y - job->firstY) * LANDSIZE * 3],
+            (job->veg != NULL) ? &job->veg[(y - job->firstY) * LANDSIZE] : NULL, LANDSIZE);
+    }
+    if (job->objects)
+      DrawObjects(job->out, LANDSIZE, 0, job->firstY, 0, firstY, LANDSIZE, endY, 1.0f);
+  }
+}
+
+// Shades rows firstY up to endY into out, on all threads.  If veg is not NULL,
+// the vegetation of the rows is written into it.  If objects is not 0, the
+// objects are drawn over the rows.
+void ShadeRows(shadeFunc shade, uchar *out, uchar *veg, int firstY, int endY, int objects)
+{
+  shadeJob job;
+
+  job.shade = shade;
+  job.out = out;
+  job.veg = veg;
+  job.firstY = firstY;
+  job.endY = endY;
+  job.objects = objects;
+  job.nextBand = 0;
+  RunJob(ShadeBands, &job);
+}
+
+// Low memory
+//
+// -lowmem never touches land.  The map file is read a row at a time into a
+// ring of three rows, which is all that the shading kernels look at, and each
+// row is shaded and written out as soon as the row below it has been read.
+// The map and picture then take up about 30 KB, rather than the 16 MB of land
+// plus a group of shaded rows.  A PNG adds its compressor's tables while a row
+// is being deflated, and comes out a little larger since each row is deflated
+// on its own.  Everything runs on the calling thread.  Shadows,
+// occlusion and the normal cache need the whole map, so they cannot be used.
+
+landData ringRows[3][LANDSIZE];
+FILE     *ringFile;
+int      ringNext;   // The next row to read into the ring
+
+static landData *RingRow(int y)
+{
+  return ((y < 0) || (y >= LANDSIZE)) ? NULL : ringRows[y % 3];
+}
+
+// Starts reading mapFile with the row above firstY
+int RingBegin(FILE *mapFile, int firstY)
+{
+  ringFile = mapFile;
+  ringNext = (firstY > 0) ? firstY - 1 : 0;
+  if (fseek(ringFile, (long)ringNext * LANDSIZE * sizeof(landData), SEEK_SET) != 0) {
+    printf("ERROR: Seek to row %d of the map file failed!\n", ringNext);
+    return 0;
+  }
+  return 1;
+}
+
+// Shades row y into out the same way ShadeRows() would, reading rows into the
+// ring until the row below it is there
+int ShadeRing(shadeFunc shade, uchar *out, uchar *veg, int y, int objects)
+{
+  while ((ringNext <= y + 1) && (ringNext < LANDSIZE)) {
+    if (fread(ringRows[ringNext % 3], sizeof(landData), LANDSIZE, ringFile) != LANDSIZE) {
+      printf("ERROR: Map file ends before row %d!\n", ringNext);
+      return 0;
+    }
+    ringNext++;
+  }
+
+  shade(RingRow(y - 1), RingRow(y), RingRow(y + 1), y, out);
+  if ((veg != NULL) || (lights.vegetationStrength > 0.0))
+    VegetationRow(RingRow(y), out, veg, LANDSIZE);
+  if (objects)
+    DrawObjects(out, LANDSIZE, 0, y, 0, y, LANDSIZE, y + 1, 1.0f);
+  return 1;
+}
+
+// High resolution
+//
+// -scale N draws every 24 unit square of the map N pixels across, for
+// pictures of (LANDSIZE - 1) * N + 1 pixels square.  Each square is cut into
+// two triangles along the diagonal from its top right to its bottom left.  A
+// pixel takes the normal, shadow and occlusion of its triangle's corners,
+// weighted by how close it is to each, so the slopes are shaded smoothly; its
+// color is the land type of the nearest corner.  Corners that are not used
+// get no weight, and a pixel nearest an unused point is green.
+//
+// The whole picture is far too big to hold, so it is shaded a group of pixel
+// rows at a time, and each group goes straight to the image writer.  Each
+// pixel row is shaded on its own from the two rows of points around it, so
+// the rows of a group are simply handed out to all the threads.
+
+#define MAXSCALE 16
+
+typedef struct {
+  float n[3];             // Unit normal
+  float shadow, occlusion;
+  int   type;             // Index into landColor, or -1 if the point is unused
+  int   vegetation;       // Vegetation class
+} scaledPoint;
+
+typedef struct {
+  int   scale, width;
+  uchar *out;
+  int   firstRow, endRow;
+  int   nextRow;
+} scaledJob;
+
+// Works out the corners for the pixels between rows y and y + 1
+static void ScaledCorners(int y, scaledPoint *corners)
+{
+  landData *prev, *row, *next;
+  float    len;
+  int      x, endX, v0, v1, count;
+
+  prev = (y > 0) ? land[y - 1] : NULL;
+  row = land[y];
+  next = (y < LANDSIZE - 1) ? land[y + 1] : NULL;
+  endX = (regionX1 < LANDSIZE - 1) ? regionX1 + 2 : LANDSIZE;
+  for (x = regionX0; x < endX; x++) {
+    if (!row[x].used) {
+      corners[x].type = -1;
+      continue;
+    }
+    corners[x].type = LandType(&row[x]);
+    corners[x].vegetation = VegetationClass(&row[x]);
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    len = (float)sqrt((double)(v0 * v0 + v1 * v1 + 144 * count * count));
+    corners[x].n[0] = (count > 0) ? v0 / len : 0.0f;
+    corners[x].n[1] = (count > 0) ? v1 / len : 0.0f;
+    corners[x].n[2] = (count > 0) ? 12.0f * count / len : 0.0f;
+    corners[x].shadow = (lights.shadowStrength > 0.0) ? (float)ShadowAt(x, y) : 0.0f;
+    corners[x].occlusion = (lights.occlusionStrength > 0.0) ? (float)OcclusionAt(x, y) : 0.0f;
+  }
+}
+
+// Shades pixel row py of the scaled picture of the whole map.  top and bottom
+// hold the corners for the rows of points cornerY and cornerY + 1, and are only
+// redone when those change.  Only the pixels of the region are shaded.
+static void ShadeScaledRow(scaledJob *job, int py, scaledPoint *top, scaledPoint *bottom, int *cornerY, uchar *out)
+{
+  scaledPoint *c[3], *nearest;
+  float       w[3], fu, fv, sum, shadow, occlusion, color;
+  double      v[3], light;
+  int         px, x, y, i, k;
+
+  y = py / job->scale;
+  if (y > LANDSIZE - 2)
+    y = LANDSIZE - 2;
+  fv = (float)(py - y * job->scale) / job->scale;
+  if (*cornerY != y) {
+    ScaledCorners(y, top);
+    ScaledCorners(y + 1, bottom);
+    *cornerY = y;
+  }
+
+  for (px = regionX0 * job->scale; px < regionX0 * job->scale + job->width; px++, out += 3) {
+    x = px / job->scale;
+    if (x > LANDSIZE - 2)
+      x = LANDSIZE - 2;
+    fu = (float)(px - x * job->scale) / job->scale;
+
+    nearest = (fv < 0.5f) ? &top[(fu < 0.5f) ? x : x + 1] : &bottom[(fu < 0.5f) ? x : x + 1];
+    if (nearest->type < 0) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+
+    // The corners of the triangle and how close the pixel is to each
+    c[1] = &top[x + 1];
+    c[2] = &bottom[x];
+    if (fu + fv <= 1.0f) {
+      c[0] = &top[x];
+      w[0] = 1.0f - fu - fv;
+      w[1] = fu;
+      w[2] = fv;
+    }
+    else {
+      c[0] = &bottom[x + 1];
+      w[0] = fu + fv - 1.0f;
+      w[1] = 1.0f - fv;
+      w[2] = 1.0f - fu;
+    }
+
+    sum = 0.0f;
+    v[0] = 0.0;
+    v[1] = 0.0;
+    v[2] = 0.0;
+    shadow = 0.0f;
+    occlusion = 0.0f;
+    for (k = 0; k < 3; k++) {
+      if (c[k]->type < 0)
+        continue;
+      sum += w[k];
+      v[0] += w[k] * c[k]->n[0];
+      v[1] += w[k] * c[k]->n[1];
+      v[2] += w[k] * c[k]->n[2];
+      shadow += w[k] * c[k]->shadow;
+      occlusion += w[k] * c[k]->occlusion;
+    }
+    if (sum <= 0.0f) {
+      // Only the nearest point is used, and it is not a corner of this triangle
+      v[0] = nearest->n[0];
+      v[1] = nearest->n[1];
+      v[2] = nearest->n[2];
+      shadow = nearest->shadow;
+      occlusion = nearest->occlusion;
+      sum = 1.0f;
+    }
+
+    light = DarkenBy(&lights, Light(&lights, v), shadow / sum, occlusion / sum);
+    if (typeTexture[nearest->type] != NULL)
+      ApplyTexture(&lights, nearest->type, x + fu, y + fv, light, out);
+    else {
+      for (i = 0; i < 3; i++) {
+        color = colorScale[i][nearest->type] * (float)light;
+        if (color > 255.0f)
+          out[i] = 255;
+        else if (color < 0.0f)
+          out[i] = 0;
+        else
+          out[i] = (uchar)color;
+      }
+    }
+
+    // The vegetation of the nearest point, as in VegetationRow()
+    if ((lights.vegetationStrength > 0.0) && (nearest->vegetation != 0)) {
+      k = (int)(lights.vegetationStrength * 256.0 + 0.5);
+      for (i = 0; i < 3; i++)
+        out[i] = (uchar)((out[i] * (256 - k) + vegetationColor[nearest->vegetation][i] * k) >> 8);
+    }
+  }
+}
+
+void ShadeScaledRows(void *ctx)
+{
+  scaledJob   *job = (scaledJob *)ctx;
+  scaledPoint *top, *bottom;
+  int         py, cornerY;
+
+  top = (scaledPoint *)malloc(2 * LANDSIZE * sizeof(scaledPoint));
+  bottom = top + LANDSIZE;
+  cornerY = -1;
+  while ((py = job->firstRow + AtomicAdd(&job->nextRow, 1)) < job->endRow)
+    ShadeScaledRow(job, py, top, bottom, &cornerY, &job->out[(long)(py - job->firstRow) * job->width * 3]);
+  free(top);
+}
+
+// Writes the picture of the region scale times larger than usual
+int WriteScaled(char *fileName, int scale)
+{
+  imageWriter image;
+  scaledJob   job;
+  int         groupRows, endRow;
+
+  job.scale = scale;
+  job.width = (regionX1 - regionX0) * scale + 1;
+  endRow = regionY1 * scale + 1;
+  groupRows = 2 * numThreads * BANDROWS;
+  job.out = (uchar *)malloc((long)groupRows * job.width * 3);
+  if (job.out == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  if (!ImageOpen(&image, fileName, job.width, endRow - regionY0 * scale, 3))
+    return -1;
+
+  for (job.firstRow = regionY0 * scale; job.firstRow < endRow; job.firstRow = job.endRow) {
+    job.endRow = (endRow - job.firstRow < groupRows) ? endRow : job.firstRow + groupRows;
+    job.nextRow = 0;
+    RunJob(ShadeScaledRows, &job);
+    ImageWriteRows(&image, job.out, job.endRow - job.firstRow);
+  }
+  ImageClose(&image);
+  free(job.out);
+
+  printf("%d x %d picture written.\n", job.width, endRow - regionY0 * scale);
+  return 0;
+}
+
+// Overviews
+//
+// -mips also writes the picture at 1024, 512, 256 and so on down to 1 pixel
+// square, each in a file named like the picture with _<size> added before its
+// extension.  The 2041 pixels are padded out to 2048 by repeating the last row
+// and column, and each level is the one above it with every 2x2 block of pixels
+// averaged.  The averaging is done on linear light rather than on the sRGB
+// values themselves, so that bright and dark detail does not come out too
+// dark.  Pixels are kept as four floats (red, green, blue and a spare) so that
+// one SSE2 vector holds a pixel.
+//
+// The levels are built as the rows come out of the shader.  A level keeps the
+// first row of each pair, summed across, until the second arrives; it then
+// has a row of its own, which is written out and passed down to the next
+// level.  So the picture is read just once and none of the levels are ever
+// held whole.
+
+#define MIPLEVELS   12
+#define MIPBATCH    64
+
+typedef struct {
+  int         size;
+  float       *pending;     // Summed across first row of a pair
+  int         havePending;
+  float       *row;         // The latest row of this level
+  uchar       *rows;        // Rows waiting to be written
+  int         numRows;
+  imageWriter image;
+} mipLevel;
+
+mipLevel mipLevels[MIPLEVELS];
+float    *mipTop;
+
+// Builds the file name for the level size pixels across
+void MipName(char *fileName, int size, char *out)
+{
+  char *dot;
+
+  dot = strrchr(fileName, '.');
+  if ((dot == NULL) || (strchr(dot, '/') != NULL) || (strchr(dot, '\\') != NULL))
+    dot = fileName + strlen(fileName);
+  sprintf(out, "%.*s_%d%s", (int)(dot - fileName), fileName, size, dot);
+}
+
+int MipBegin(char *fileName)
+{
+  char name[1024];
+  int  l;
+
+  mipTop = (float *)malloc(2048 * 4 * sizeof(float));
+  if (mipTop == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return 0;
+  }
+  for (l = 1; l < MIPLEVELS; l++) {
+    mipLevels[l].size = 2048 >> l;
+    mipLevels[l].pending = (float *)malloc(mipLevels[l].size * 4 * sizeof(float));
+    mipLevels[l].row = (float *)malloc(mipLevels[l].size * 4 * sizeof(float));
+    mipLevels[l].rows = (uchar *)malloc(MIPBATCH * mipLevels[l].size * 3);
+    mipLevels[l].havePending = 0;
+    mipLevels[l].numRows = 0;
+    if ((mipLevels[l].pending == NULL) || (mipLevels[l].row == NULL) ||
+        (mipLevels[l].rows == NULL)) {
+      printf("ERROR: Out of memory!\n");
+      return 0;
+    }
+    if (strlen(fileName) > sizeof(name) - 16) {
+      printf("ERROR: File name %s is too long!\n", fileName);
+      return 0;
+    }
+    MipName(fileName, mipLevels[l].size, name);
+    if (!ImageOpen(&mipLevels[l].image, name, mipLevels[l].size, mipLevels[l].size, 3))
+      return 0;
+  }
+  return 1;
+}
+
+// Adds up each pair of pixels of row across into out, which is half as wide
+static void MipAcross(float *row, float *out, int size)
+{
+  int i;
+
+#if SIMDWIDTH > 1
+  for (i = 0; i < size; i++)
+    _mm_storeu_ps(&out[i * 4], _mm_add_ps(_mm_loadu_ps(&row[i * 8]), _mm_loadu_ps(&row[i * 8 + 4])));
+#else
+  int c;
+
+  for (i = 0; i < size; i++) {
+    for (c = 0; c < 4; c++)
+      out[i * 4 + c] = row[i * 8 + c] + row[i * 8 + 4 + c];
+  }
+#endif
+}
+
+// Takes row, twice as wide as level l, from the level above
+static void MipFeed(int l, float *row)
+{
+  mipLevel *level = &mipLevels[l];
+  uchar    *out;
+  int      i, c, v[4];
+
+  if (!level->havePending) {
+    MipAcross(row, level->pending, level->size);
+    level->havePending = 1;
+    return;
+  }
+  level->havePending = 0;
+
+  MipAcross(row, level->row, level->size);
+  out = &level->rows[level->numRows * level->size * 3];
+  for (i = 0; i < level->size; i++) {
+#if SIMDWIDTH > 1
+    __m128 p;
+
+    p = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&level->row[i * 4]), _mm_loadu_ps(&level->pending[i * 4])),
+        _mm_set1_ps(0.25f));
+    _mm_storeu_ps(&level->row[i * 4], p);
+    // Rounded as LinearToGamma() does, by adding a half and truncating
+    _mm_storeu_si128((__m128i *)v, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(p, _mm_set1_ps((float)GAMMATABLE)),
+        _mm_set1_ps(0.5f))));
+#else
+    for (c = 0; c < 4; c++) {
+      level->row[i * 4 + c] = (level->row[i * 4 + c] + level->pending[i * 4 + c]) * 0.25f;
+      v[c] = (int)(level->row[i * 4 + c] * GAMMATABLE + 0.5f);
+    }
+#endif
+    for (c = 0; c < 3; c++)
+      out[i * 3 + c] = linearToGamma[(v[c] < 0) ? 0 : (v[c] > GAMMATABLE) ? GAMMATABLE : v[c]];
+  }
+  level->numRows++;
+  if (level->numRows == MIPBATCH) {
+    ImageWriteRows(&level->image, level->rows, level->numRows);
+    level->numRows = 0;
+  }
+
+  if (l + 1 < MIPLEVELS)
+    MipFeed(l + 1, level->row);
+}
+
+// Takes numRows rows of the picture
+void MipRows(uchar *rows, int numRows)
+{
+  uchar *p;
+  int   y, x, c;
+
+  for (y = 0; y < numRows; y++) {
+    for (x = 0; x < 2048; x++) {
+      // Past the edge, p stays on the last pixel of the row
+      if (x < LANDSIZE)
+        p = &rows[(y * LANDSIZE + x) * 3];
+      for (c = 0; c < 3; c++)
+        mipTop[x * 4 + c] = gammaToLinear[p[c]];
+      mipTop[x * 4 + 3] = 0.0f;
+    }
+    MipFeed(1, mipTop);
+  }
+}
+
+// Pads out the picture with copies of its last row and writes the levels
+void MipEnd()
+{
+  int y, l;
+
+  for (y = LANDSIZE; y < 2048; y++)
+    MipFeed(1, mipTop);
+  for (l = 1; l < MIPLEVELS; l++) {
+    if (mipLevels[l].numRows > 0)
+      ImageWriteRows(&mipLevels[l].image, mipLevels[l].rows, mipLevels[l].numRows);
+    ImageClose(&mipLevels[l].image);
+    free(mipLevels[l].pending);
+    free(mipLevels[l].row);
+    free(mipLevels[l].rows);
+  }
+  free(mipTop);
+}
+
+// Updates
+//
+// mapac records the landblocks it changed in <MAP FILE>.dirty (see mapac.c).
+// With -update, graphac re-shades only the points of those landblocks, and the
+// points around them whose shading they change, in an existing RAW picture, or
+// with -tiles, rewrites only the tiles that show them.  Updated points of a
+// RAW picture are shaded with the reference path.  The dirty file is left
+// alone, since more than one picture may need updating; delete it once they
+// all are.
+
+uchar dirtyBlock[256][256];
+
+// Reads the dirty file for a map.  Returns the number of dirty landblocks, or
+// -1 if there is no dirty file.
+int ReadDirty(char *mapName)
+{
+  FILE *dirtyFile;
+  char *fileName;
+  int  x, y, numDirty;
+
+  fileName = (char *)malloc(strlen(mapName) + 7);
+  sprintf(fileName, "%s.dirty", mapName);
+  dirtyFile = fopen(fileName, "rb");
+  if ((dirtyFile == NULL) || (fread(dirtyBlock, sizeof(dirtyBlock), 1, dirtyFile) != 1)) {
+    printf("ERROR: File %s could not be read!\n", fileName);
+    if (dirtyFile != NULL)
+      fclose(dirtyFile);
+    free(fileName);
+    return -1;
+  }
+  fclose(dirtyFile);
+  free(fileName);
+
+  numDirty = 0;
+  for (x = 0; x < 256; x++) {
+    for (y = 0; y < 256; y++) {
+      if (dirtyBlock[x][y])
+        numDirty++;
+    }
+  }
+  return numDirty;
+}
+
+// Works out how far past a landblock, on each side, a change to it can change
+// the shading: one point for the normals it is part of, the radius of any
+// occlusion, and with shadows, as far as a shadow from the highest point can
+// fall before the light that casts it drops to the ground (see Shadows above)
+void DirtyReach(int *left, int *right, int *up, int *down)
+{
+  double dx, dy, major, drop;
+  int    steps;
+
+  *left = *right = *up = *down = 1;
+  if (lights.occlusionStrength > 0.0)
+    *left = *right = *up = *down = lights.occlusionRadius + 1;
+
+  dx = -lights.lightVector[0];
+  dy = -lights.lightVector[1];
+  if ((lights.shadowStrength > 0.0) && ((dx != 0.0) || (dy != 0.0))) {
+    major = (fabs(dx) > fabs(dy)) ? fabs(dx) : fabs(dy);
+    drop = sqrt(dx * dx + dy * dy) / major * 12.0 * tan(lights.shadowElevation * 3.14159265358979 / 180.0);
+    steps = (int)ceil(255.0 / drop);
+    if (dx > 0.0)
+      *right += (int)ceil(steps * dx / major);
+    else
+      *left += (int)ceil(steps * -dx / major);
+    if (dy > 0.0)
+      *down += (int)ceil(steps * dy / major);
+    else
+      *up += (int)ceil(steps * -dy / major);
+  }
+}
+
+// Marks in mask, which is stride points wide, the points of the dirty
+// landblocks and the points whose shading they reach
+void DirtyPoints(uchar *mask, int stride)
+{
+  int blockX, blockY, x0, y0, x1, y1, y, left, right, up, down;
+
+  DirtyReach(&left, &right, &up, &down);
+  for (blockX = 0; blockX < 255; blockX++) {
+    for (blockY = 0; blockY < 255; blockY++) {
+      if (!dirtyBlock[blockX][blockY])
+        continue;
+      x0 = blockX * 8 - left;
+      x1 = blockX * 8 + 8 + right;
+      y0 = LANDSIZE - blockY * 8 - 9 - up;
+      y1 = LANDSIZE - blockY * 8 - 1 + down;
+      x0 = (x0 < 0) ? 0 : x0;
+      y0 = (y0 < 0) ? 0 : y0;
+      x1 = (x1 > LANDSIZE - 1) ? LANDSIZE - 1 : x1;
+      y1 = (y1 > LANDSIZE - 1) ? LANDSIZE - 1 : y1;
+      for (y = y0; y <= y1; y++)
+        memset(&mask[(long)y * stride + x0], 1, x1 - x0 + 1);
+    }
+  }
+}
+
+// Re-shades the dirty landblocks, and the points around them, in an existing
+// RAW picture
+int UpdateRaw(char *fileName)
+{
+  FILE  *topoFile;
+  uchar pixels[LANDSIZE * 3], *mask;
+  int   y, startX, endX;
+
+  topoFile = fopen(fileName, "r+b");
+  if (topoFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return -1;
+  }
+  fseek(topoFile, 0, SEEK_END);
+  if (ftell(topoFile) != (long)LANDSIZE * LANDSIZE * 3) {
+    printf("ERROR: File %s is not a RAW picture of the whole map!\n", fileName);
+    fclose(topoFile);
+    return -1;
+  }
+
+  mask = (uchar *)calloc(LANDSIZE, LANDSIZE);
+  if (mask == NULL) {
+    printf("ERROR: Out of memory!\n");
+    fclose(topoFile);
+    return -1;
+  }
+  DirtyPoints(mask, LANDSIZE);
+
+  // Each run of marked points in a row is shaded and written in one go
+  for (y = 0; y < LANDSIZE; y++) {
+    for (startX = 0; startX < LANDSIZE; startX = endX) {
+      for (; (startX < LANDSIZE) && !mask[y * LANDSIZE + startX]; startX++)
+        ;
+      for (endX = startX; (endX < LANDSIZE) && mask[y * LANDSIZE + endX]; endX++) {
+        ShadePoint(&lights, (y > 0) ? land[y - 1] : NULL, land[y], (y < LANDSIZE - 1) ? land[y + 1] : NULL,
+            endX, y, &pixels[endX * 3]);
+      }
+      if (endX > startX) {
+        VegetationRow(&land[y][startX], &pixels[startX * 3], NULL, endX - startX);
+        fseek(topoFile, ((long)y * LANDSIZE + startX) * 3, SEEK_SET);
+        fwrite(&pixels[startX * 3], 1, (endX - startX) * 3, topoFile);
+      }
+    }
+  }
+  fclose(topoFile);
+  free(mask);
+
+  printf("Land blocks updated.\n");
+  return 0;
+}
+
+// Tiles
+//
+// -tiles writes an XYZ tile pyramid for a slippy map viewer instead of one
+// picture.  Tiles are TILESIZE pixels square and are saved as
+// <DIRECTORY>/<zoom>/<x>/<y>.png.  At zoom TILEZOOM there is one pixel per point
+// (the 2041 points are padded out to 2048 with unused ones).  Each shallower
+// zoom is box filtered from the one below it, and deeper zooms, up to
+// -maxzoom (at most MAXTILEZOOM, where a point is 64 pixels across), are
+// upsampled bilinearly.  Tiles without a single used point are
+// not written.  Tiles are rendered and compressed in parallel, one per thread.
+// Objects are drawn over each tile as it is rendered (see Objects above).
+// The shaded levels down to TILEZOOM are kept in <DIRECTORY>/levels.raw.  With
+// -update they are read back, and only the dirty points and the points around
+// them are shaded again.  Only the pixels of the shallower levels that those
+// feed are filtered again, and only the tiles that show them are written.
+
+#define TILESIZE    256
+#define TILEZOOM    3
+#define TILECANVAS  (TILESIZE << TILEZOOM)
+#define MAXTILEZOOM (TILEZOOM + 6)
+
+typedef struct {
+  int   size;
+  uchar *pixels;
+  uchar *used;
+  uchar *dirty;   // Pixels to redo with -update, or NULL to do them all
+} tileLevel;
+
+typedef struct {
+  char      *dir;
+  tileLevel *level;
+  int       zoom, scale;
+  int       numTiles;
+  int       update;
+  int       nextTile;
+  int       written, failed;
+} tileJob;
+
+// Returns 1 if mask, one byte per pixel of the job's level, is set for any
+// pixel under tile (tx, ty)
+int TileAny(tileJob *job, int tx, int ty, uchar *mask)
+{
+  int x, y, x0, y0, x1, y1;
+
+  // Deeper zooms also look one point past the tile, for the bilinear filter
+  x0 = tx * TILESIZE / job->scale - 1;
+  y0 = ty * TILESIZE / job->scale - 1;
+  x1 = (tx + 1) * TILESIZE / job->scale + 1;
+  y1 = (ty + 1) * TILESIZE / job->scale + 1;
+  if (job->scale == 1) {
+    x0++;
+    y0++;
+    x1--;
+    y1--;
+  }
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > job->level->size)
+    x1 = job->level->size;
+  if (y1 > job->level->size)
+    y1 = job->level->size;
+
+  for (y = y0; y < y1; y++) {
+    for (x = x0; x < x1; x++) {
+      if (mask[y * job->level->size + x])
+        return 1;
+    }
+  }
+  return 0;
+}
+
+void FillTile(tileJob *job, int tx, int ty, uchar *tile)
+{
+  tileLevel *level = job->level;
+  uchar     *p00, *p01, *p10, *p11;
+  int       x, y, i, x0, y0, x1, y1;
+  float     u, v, fx, fy;
+
+  if (job->scale == 1) {
+    for (y = 0; y < TILESIZE; y++) {
+      memcpy(&tile[y * TILESIZE * 3], &level->pixels[((ty * TILESIZE + y) * level->size + tx * TILESIZE) * 3],
+          TILESIZE * 3);
+    }
+    return;
+  }
+
+  for (y = 0; y < TILESIZE; y++) {
+    v = (ty * TILESIZE + y + 0.5f) / job->scale - 0.5f;
+    y0 = (int)floor(v);
+    fy = v - y0;
+    y1 = y0 + 1;
+    if (y0 < 0)
+      y0 = 0;
+    if (y1 > level->size - 1)
+      y1 = level->size - 1;
+    for (x = 0; x < TILESIZE; x++) {
+      u = (tx * TILESIZE + x + 0.5f) / job->scale - 0.5f;
+      x0 = (int)floor(u);
+      fx = u - x0;
+      x1 = x0 + 1;
+      if (x0 < 0)
+        x0 = 0;
+      if (x1 > level->size - 1)
+        x1 = level->size - 1;
+      p00 = &level->pixels[(y0 * level->size + x0) * 3];
+      p01 = &level->pixels[(y0 * level->size + x1) * 3];
+      p10 = &level->pixels[(y1 * level->size + x0) * 3];
+      p11 = &level->pixels[(y1 * level->size + x1) * 3];
+      for (i = 0; i < 3; i++) {
+        tile[(y * TILESIZE + x) * 3 + i] = (uchar)(((p00[i] * (1.0f - fx) + p01[i] * fx) * (1.0f - fy) +
+            (p10[i] * (1.0f - fx) + p11[i] * fx) * fy) + 0.5f);
+      }
+    }
+  }
+}
+
+void RenderTiles(void *ctx)
+{
+  tileJob     *job = (tileJob *)ctx;
+  imageWriter image;
+  uchar       *tile;
+  char        fileName[1024];
+  int         n, tx, ty;
+
+  tile = (uchar *)malloc(TILESIZE * TILESIZE * 3);
+  while ((n = AtomicAdd(&job->nextTile, 1)) < job->numTiles * job->numTiles) {
+    tx = n % job->numTiles;
+    ty = n / job->numTiles;
+    if (!TileAny(job, tx, ty, job->level->used) || (job->update && !TileAny(job, tx, ty, job->level->dirty)))
+      continue;
+
+    FillTile(job, tx, ty, tile);
+    if (job->zoom >= OBJECTMINZOOM) {
+      DrawObjects(tile, TILESIZE, tx * TILESIZE, ty * TILESIZE, tx * TILESIZE, ty * TILESIZE,
+          (tx + 1) * TILESIZE, (ty + 1) * TILESIZE, (float)(TILESIZE << job->zoom) / TILECANVAS);
+    }
+    sprintf(fileName, "%s/%d/%d/%d.png", job->dir, job->zoom, tx, ty);
+    if (!ImageOpen(&image, fileName, TILESIZE, TILESIZE, 3)) {
+      AtomicAdd(&job->failed, 1);
+      continue;
+    }
+    image.png.serial = 1;
+    ImageWriteRows(&image, tile, TILESIZE);
+    ImageClose(&image);
+    AtomicAdd(&job->written, 1);
+  }
+  free(tile);
+}
+
+// Halves level into half, averaging each 2x2 block of pixels.  A point of half
+// is used if any of the four below it is, and dirty if any of them is.  Only
+// dirty pixels are averaged, unless level->dirty is NULL.
+void BoxFilter(tileLevel *level, tileLevel *half)
+{
+  int   x, y, i, s;
+  uchar *p;
+
+  s = level->size;
+  for (y = 0; y < half->size; y++) {
+    for (x = 0; x < half->size; x++) {
+      half->used[y * half->size + x] = level->used[2 * y * s + 2 * x] | level->used[2 * y * s + 2 * x + 1] |
+          level->used[(2 * y + 1) * s + 2 * x] | level->used[(2 * y + 1) * s + 2 * x + 1];
+      if (level->dirty != NULL) {
+        half->dirty[y * half->size + x] = level->dirty[2 * y * s + 2 * x] | level->dirty[2 * y * s + 2 * x + 1] |
+            level->dirty[(2 * y + 1) * s + 2 * x] | level->dirty[(2 * y + 1) * s + 2 * x + 1];
+        if (!half->dirty[y * half->size + x])
+          continue;
+      }
+      p = &level->pixels[(2 * y * s + 2 * x) * 3];
+      for (i = 0; i < 3; i++)
+        half->pixels[(y * half->size + x) * 3 + i] = (p[i] + p[i + 3] + p[s * 3 + i] + p[s * 3 + i + 3] + 2) >> 2;
+    }
+  }
+}
+
+// Reads (mode "rb") or writes (mode "wb") the pixels of the levels in
+// <dir>/levels.raw.  Returns 0 if they cannot be.
+int LevelsFile(char *dir, tileLevel *level, const char *mode)
+{
+  FILE   *levelsFile;
+  char   fileName[1024];
+  size_t len;
+  int    zoom, ok;
+
+  sprintf(fileName, "%s/levels.raw", dir);
+  levelsFile = fopen(fileName, mode);
+  if (levelsFile == NULL)
+    return 0;
+  ok = 1;
+  for (zoom = 0; zoom <= TILEZOOM; zoom++) {
+    len = (size_t)level[zoom].size * level[zoom].size * 3;
+    if (mode[0] == 'r')
+      ok &= (fread(level[zoom].pixels, 1, len, levelsFile) == len);
+    else
+      ok &= (fwrite(level[zoom].pixels, 1, len, levelsFile) == len);
+  }
+  if ((mode[0] == 'r') && (fgetc(levelsFile) != EOF))
+    ok = 0;
+  if (fclose(levelsFile) != 0)
+    ok = 0;
+  return ok;
+}
+
+int WriteTiles(shadeFunc shade, char *dir, int maxZoom, int update)
+{
+  tileLevel level[TILEZOOM + 1];
+  tileLevel *canvas = &level[TILEZOOM];
+  tileJob   job;
+  char      dirName[1024];
+  uchar     *rows;
+  int       zoom, x, y, endY, maxRows, i;
+
+  for (zoom = 0; zoom <= TILEZOOM; zoom++) {
+    level[zoom].size = TILESIZE << zoom;
+    level[zoom].pixels = (uchar *)malloc(level[zoom].size * level[zoom].size * 3);
+    level[zoom].used = (uchar *)malloc(level[zoom].size * level[zoom].size);
+    level[zoom].dirty = update ? (uchar *)calloc(level[zoom].size, level[zoom].size) : NULL;
+    if ((level[zoom].pixels == NULL) || (level[zoom].used == NULL) || (update && (level[zoom].dirty == NULL))) {
+      printf("ERROR: Out of memory!\n");
+      return -1;
+    }
+  }
+  if (update && !LevelsFile(dir, level, "rb")) {
+    printf("ERROR: File %s/levels.raw could not be read!  Write the tiles once without -update.\n", dir);
+    return -1;
+  }
+
+  // Shade the map into the TILEZOOM canvas.  The padding is unused, so green.
+  // With -update only the rows holding dirty points are shaded, and only those
+  // points are copied in.
+  for (y = 0; y < TILECANVAS; y++) {
+    for (x = 0; x < TILECANVAS; x++) {
+      if (!update) {
+        canvas->pixels[(y * TILECANVAS + x) * 3] = 0;
+        canvas->pixels[(y * TILECANVAS + x) * 3 + 1] = 0xFF;
+        canvas->pixels[(y * TILECANVAS + x) * 3 + 2] = 0;
+      }
+      canvas->used[y * TILECANVAS + x] = (x < LANDSIZE) && (y < LANDSIZE) && land[y][x].used;
+    }
+  }
+  if (update)
+    DirtyPoints(canvas->dirty, TILECANVAS);
+  maxRows = BANDROWS * numThreads;
+  rows = (uchar *)malloc(maxRows * LANDSIZE * 3);
+  for (y = 0; y < LANDSIZE; y = endY) {
+    if (update) {
+      for (; (y < LANDSIZE) && (memchr(&canvas->dirty[y * TILECANVAS], 1, LANDSIZE) == NULL); y++)
+        ;
+      for (endY = y; (endY < LANDSIZE) && (endY - y < maxRows) &&
+          (memchr(&canvas->dirty[endY * TILECANVAS], 1, LANDSIZE) != NULL); endY++)
+        ;
+      if (endY == y)
+        break;
+    }
+    else
+      endY = (LANDSIZE - y < maxRows) ? LANDSIZE : y + maxRows;
+    ShadeRows(shade, rows, NULL, y, endY, 0);
+    for (i = 0; i < endY - y; i++) {
+      if (!update)
+        memcpy(&canvas->pixels[(y + i) * TILECANVAS * 3], &rows[i * LANDSIZE * 3], LANDSIZE * 3);
+      for (x = 0; update && (x < LANDSIZE); x++) {
+        if (canvas->dirty[(y + i) * TILECANVAS + x])
+          memcpy(&canvas->pixels[((y + i) * TILECANVAS + x) * 3], &rows[(i * LANDSIZE + x) * 3], 3);
+      }
+    }
+  }
+  free(rows);
+
+  for (zoom = TILEZOOM; zoom > 0; zoom--)
+    BoxFilter(&level[zoom], &level[zoom - 1]);
+
+  MakeDir(dir);
+  if (!LevelsFile(dir, level, "wb")) {
+    printf("ERROR: File %s/levels.raw could not be written!\n", dir);
+    return -1;
+  }
+  job.dir = dir;
+  job.update = update;
+  job.written = 0;
+  job.failed = 0;
+  for (zoom = 0; zoom <= maxZoom; zoom++) {
+    job.zoom = zoom;
+    job.numTiles = 1 << zoom;
+    job.level = &level[(zoom < TILEZOOM) ? zoom : TILEZOOM];
+    job.scale = (zoom > TILEZOOM) ? 1 << (zoom - TILEZOOM) : 1;
+    job.nextTile = 0;
+
+    sprintf(dirName, "%s/%d", dir, zoom);
+    MakeDir(dirName);
+    for (x = 0; x < job.numTiles; x++) {
+      sprintf(dirName, "%s/%d/%d", dir, zoom, x);
+      MakeDir(dirName);
+    }
+    RunJob(RenderTiles, &job);
+  }
+
+  for (zoom = 0; zoom <= TILEZOOM; zoom++) {
+    free(level[zoom].pixels);
+    free(level[zoom].used);
+    free(level[zoom].dirty);
+  }
+
+  printf("%d tiles written.\n", job.written);
+  return (job.failed > 0) ? -1 : 0;
+}
+
+// Regions
+//
+// -region, -blocks and -loc draw just part of the map.  -region gives the
+// corners in points, which are the pixels of the usual picture.  -blocks gives
+// the landblocks in two corners, in hex like 7F7F.  -loc gives two corners as
+// /loc coordinates like 42.1N 33.6E, where the map runs from 102.0S to 102.0N
+// and from 102.0W to 102.0E, 0.1 to a point.  Only the parts of the rows of
+// the map file under the region, and the points around it for the normals, are
+// read.  Just the rows of the region are shaded, and they are cut down to the
+// region as they are written.  The points that were not read are unused, and
+// the shading gets past those quickly.  Shadows and ambient occlusion are cast
+// from well outside the region, so with them in any picture the whole map is
+// read and they are worked out for all of it.
+
+// Sets the region to the points from (x0, y0) to (x1, y1), in either order,
+// taking in every point they touch.  Returns 0 if none of it is on the map.
+int SetRegion(double x0, double y0, double x1, double y1)
+{
+  double t;
+
+  if (x0 > x1) {
+    t = x0;
+    x0 = x1;
+    x1 = t;
+  }
+  if (y0 > y1) {
+    t = y0;
+    y0 = y1;
+    y1 = t;
+  }
+  if ((x1 < 0.0) || (y1 < 0.0) || (x0 > LANDSIZE - 1) || (y0 > LANDSIZE - 1))
+    return 0;
+  regionX0 = (x0 > 0.0) ? (int)floor(x0) : 0;
+  regionY0 = (y0 > 0.0) ? (int)floor(y0) : 0;
+  regionX1 = (x1 < LANDSIZE - 1) ? (int)ceil(x1) : LANDSIZE - 1;
+  regionY1 = (y1 < LANDSIZE - 1) ? (int)ceil(y1) : LANDSIZE - 1;
+  return 1;
+}
+
+// Reads a landblock id in hex, xxyy or xxyyFFFF, into the points of its corners
+int ParseBlock(char *id, double *x0, double *y0, double *x1, double *y1)
+{
+  char *end;
+  uint block;
+
+  block = (uint)strtoul(id, &end, 16);
+  if ((*end != '\0') || (end == id))
+    return 0;
+  if (block > 0xFFFF)
+    block >>= 16;
+  *x0 = (block >> 8) * 8;
+  *x1 = *x0 + 8;
+  *y1 = LANDSIZE - 1 - (block & 0xFF) * 8;
+  *y0 = *y1 - 8;
+  return 1;
+}
+
+// Reads a /loc coordinate, like 42.1N 33.6E, into a point
+int ParseLoc(char *ns, char *ew, double *x, double *y)
+{
+  char   *end;
+  double n, e;
+
+  n = strtod(ns, &end);
+  if ((end == ns) || ((*end != 'N') && (*end != 'n') && (*end != 'S') && (*end != 's')))
+    return 0;
+  if ((*end == 'S') || (*end == 's'))
+    n = -n;
+  e = strtod(ew, &end);
+  if ((end == ew) || ((*end != 'E') && (*end != 'e') && (*end != 'W') && (*end != 'w')))
+    return 0;
+  if ((*end == 'W') || (*end == 'w'))
+    e = -e;
+
+  *x = (e + 102.0) * 10.0;
+  *y = LANDSIZE - 1 - (n + 102.0) * 10.0;
+  return 1;
+}
+
+// Reads the parts of the rows of the map file under the region, and one point
+// around it
+void ReadRegion(FILE *mapFile)
+{
+  int x0, y0, x1, y1, y;
+
+  x0 = (regionX0 > 0) ? regionX0 - 1 : 0;
+  y0 = (regionY0 > 0) ? regionY0 - 1 : 0;
+  x1 = (regionX1 < LANDSIZE - 1) ? regionX1 + 1 : LANDSIZE - 1;
+  y1 = (regionY1 < LANDSIZE - 1) ? regionY1 + 1 : LANDSIZE - 1;
+  for (y = y0; y <= y1; y++) {
+    if (fseek(mapFile, ((long)y * LANDSIZE + x0) * sizeof(landData), SEEK_SET) != 0)
+      return;
+    fread(&land[y][x0], sizeof(landData), x1 - x0 + 1, mapFile);
+  }
+}
+
+// Cuts rows of the width of the map down to the region, in place
+void CropRows(uchar *rows, int numRows, int channels)
+{
+  int width, y;
+
+  width = regionX1 - regionX0 + 1;
+  if (width == LANDSIZE)
+    return;
+  for (y = 0; y < numRows; y++)
+    memmove(&rows[y * width * channels], &rows[(y * LANDSIZE + regionX0) * channels], width * channels);
+}
+
+// Variants
+//
+// -variant <CONFIG> <GRAPHICS FILE> also writes the map with the settings in
+// CONFIG applied on top of the others.  It may be given up to MAXVARIANTS
+// times, so that several times of day or color schemes come out of one run.
+// The normal, land type and vegetation class of each point are worked out
+// once, a band of rows at a time, into a packedPoint of six bytes.  Every
+// picture is then shaded from the band while it is still in the cache.  The
+// bands are handed out to all the threads.  Each picture is shaded exactly as
+// ShadeRow() would, whichever kernel was asked for.  Each variant casts its own
+// shadows.  Variants whose occlusion looks as far in as many directions share
+// it.  Textures and the -vegetation picture cannot be used with variants.
+
+#define MAXVARIANTS 16
+#define PACKEDUNUSED 63
+
+typedef struct {
+  short  v0, v1;   // Normal, as from PointNormal()
+  ushort info;     // Land type (PACKEDUNUSED if unused), neighbour pairs << 6 and
+                   // vegetation class << 9
+} packedPoint;
+
+typedef struct {
+  lighting    lt;
+  uchar       *shadowMask, *occlusionMask;
+  char        *fileName;
+  imageWriter image;
+  uchar       *rows;
+} variant;
+
+// The main picture is variant 0
+variant variants[MAXVARIANTS + 1];
+int     numVariants;
+
+typedef struct {
+  int firstY, endY;
+  int nextBand;
+} variantJob;
+
+void PackRow(landData *prev, landData *row, landData *next, int y, packedPoint *out)
+{
+  int x, v0, v1, count;
+
+  for (x = 0; x < LANDSIZE; x++) {
+    if (!row[x].used) {
+      out[x].info = PACKEDUNUSED;
+      continue;
+    }
+    count = PointNormal(prev, row, next, x, y, &v0, &v1);
+    out[x].v0 = (short)v0;
+    out[x].v1 = (short)v1;
+    out[x].info = (ushort)(LandType(&row[x]) | count << 6 | VegetationClass(&row[x]) << 9);
+  }
+}
+
+// Shades row y of a variant from its packed points
+void ShadeVariantRow(variant *var, packedPoint *row, int y, uchar *out)
+{
+  const lighting *lt = &var->lt;
+  double         v[3], light;
+  int            x, i, n, a;
+
+  a = (int)(lt->vegetationStrength * 256.0 + 0.5);
+  for (x = 0; x < LANDSIZE; x++, out += 3) {
+    if ((row[x].info & 0x3F) == PACKEDUNUSED) {
+      out[0] = 0;
+      out[1] = 0xFF;
+      out[2] = 0;
+      continue;
+    }
+    v[0] = row[x].v0;
+    v[1] = row[x].v1;
+    v[2] = 12.0 * ((row[x].info >> 6) & 0x07);
+    light = DarkenBy(lt, Light(lt, v),
+        ((lt->shadowStrength > 0.0) && (var->shadowMask != NULL)) ? var->shadowMask[y * LANDSIZE + x] : 0,
+        ((lt->occlusionStrength > 0.0) && (var->occlusionMask != NULL)) ? var->occlusionMask[y * LANDSIZE + x] : 0);
+    ApplyLight(lt, row[x].info & 0x3F, light, out);
+
+    // As in VegetationRow()
+    n = row[x].info >> 9;
+    if ((lt->vegetationStrength > 0.0) && (n != 0)) {
+      for (i = 0; i < 3; i++)
+        out[i] = (uchar)((out[i] * (256 - a) + vegetationColor[n][i] * a) >> 8);
+    }
+  }
+}
+
+void VariantBands(void *ctx)
+{
+  variantJob  *job = (variantJob *)ctx;
+  packedPoint *packed;
+  int         band, y, firstY, endY, i;
+
+  packed = (packedPoint *)malloc(BANDROWS * LANDSIZE * sizeof(packedPoint));
+  while ((firstY = job->firstY + (band = AtomicAdd(&job->nextBand, 1)) * BANDROWS) < job->endY) {
+    endY = firstY + BANDROWS;
+    if (endY > job->endY)
+      endY = job->endY;
+    for (y = firstY; y < endY; y++) {
+      PackRow((y > 0) ? land[y - 1] : NULL, land[y], (y < LANDSIZE - 1) ? land[y + 1] : NULL, y,
+          &packed[(y - firstY) * LANDSIZE]);
+    }
+    for (i = 0; i < numVariants; i++) {
+      for (y = firstY; y < endY; y++)
+        ShadeVariantRow(&variants[i], &packed[(y - firstY) * LANDSIZE], y, &variants[i].rows[(y - job->firstY) * LANDSIZE * 3]);
+      DrawObjects(variants[i].rows, LANDSIZE, 0, job->firstY, 0, firstY, LANDSIZE, endY, 1.0f);
+    }
+  }
+  free(packed);
+}
+
+// Works out the shadows and occlusion of each variant after the main picture,
+// whose are already done.  lights is set to each variant in turn for
+// ComputeShadows() and ComputeOcclusion(), and put back after.
+int VariantMasks()
+{
+  int i, j;
+
+  variants[0].shadowMask = shadowMask;
+  variants[0].occlusionMask = occlusionMask;
+  for (i = 1; i < numVariants; i++) {
+    memcpy(&lights, &variants[i].lt, sizeof(lighting));
+    shadowMask = NULL;
+    occlusionMask = NULL;
+    if (!ComputeShadows())
+      return 0;
+    for (j = 0; j < i; j++) {
+      if ((variants[j].occlusionMask != NULL) && (variants[i].lt.occlusionStrength > 0.0) &&
+          (variants[j].lt.occlusionDirections == variants[i].lt.occlusionDirections) &&
+          (variants[j].lt.occlusionRadius == variants[i].lt.occlusionRadius))
+        occlusionMask = variants[j].occlusionMask;
+    }
+    if ((occlusionMask == NULL) && !ComputeOcclusion())
+      return 0;
+    variants[i].shadowMask = shadowMask;
+    variants[i].occlusionMask = occlusionMask;
+  }
+  memcpy(&lights, &variants[0].lt, sizeof(lighting));
+  shadowMask = variants[0].shadowMask;
+  occlusionMask = variants[0].occlusionMask;
+  return 1;
+}
+
+// Shades and writes all the variants of the region, a group of rows at a time
+int WriteVariants()
+{
+  variantJob job;
+  int        groupRows, numRows, width, height, i;
+
+  if (!VariantMasks())
+    return -1;
+
+  groupRows = 2 * numThreads * BANDROWS;
+  width = regionX1 - regionX0 + 1;
+  height = regionY1 - regionY0 + 1;
+  for (i = 0; i < numVariants; i++) {
+    variants[i].rows = (uchar *)malloc(groupRows * LANDSIZE * 3);
+    if (variants[i].rows == NULL) {
+      printf("ERROR: Out of memory!\n");
+      return -1;
+    }
+    if (!ImageOpen(&variants[i].image, variants[i].fileName, width, height, 3))
+      return -1;
+  }
+
+  for (job.firstY = regionY0; job.firstY <= regionY1; job.firstY += numRows) {
+    numRows = (regionY1 + 1 - job.firstY < groupRows) ? regionY1 + 1 - job.firstY : groupRows;
+    job.endY = job.firstY + numRows;
+    job.nextBand = 0;
+    RunJob(VariantBands, &job);
+    for (i = 0; i < numVariants; i++) {
+      CropRows(variants[i].rows, numRows, 3);
+      ImageWriteRows(&variants[i].image, variants[i].rows, numRows);
+    }
+  }
+
+  for (i = 0; i < numVariants; i++) {
+    ImageClose(&variants[i].image);
+    free(variants[i].rows);
+  }
+  printf("%d pictures written.\n", numVariants);
+  return 0;
+}
+
+// Views
+//
+// -view <X> <Y> <ALT> <HEADING> <PITCH> draws the land in perspective from a
+// camera over point (X, Y), ALT game units up (heights are 2.0 * Z), looking
+// HEADING degrees clockwise from north and PITCH degrees down.  -fov sets how
+// many degrees the picture takes in across and -size its size in pixels.
+//
+// The whole map is shaded first, with whatever kernel, lighting, textures and
+// objects were asked for, and the view takes its colors from that picture.
+// The camera is pitched by shifting the picture down rather than by tilting
+// it, the way an architect's shift lens does, so upright lines stay upright
+// and each column of pixels looks out along one upright slice of the land.
+// Each column is then drawn by marching a single ray across the map from near
+// to far, like the old voxel space games did.  Land is drawn from where it
+// lands in the column up to the highest pixel drawn so far, so nearer land
+// hides what is behind it, and the column is done once it is full.  Heights
+// and colors are interpolated between points.
+//
+// A max height pyramid over the cells of the map, like the one for ambient
+// occlusion, lets a ray skip land that cannot rise above what its column
+// already has: the ray takes the biggest square of the pyramid around it that
+// is too low to show, and jumps to where it leaves the square.  The columns
+// are handed out to the threads in bands of BANDROWS.
+
+#define VIEWWIDTH  1920
+#define VIEWHEIGHT 1080
+#define VIEWFOV    60.0
+#define MAXVIEWSIZE 8192
+
+// The ray starts VIEWNEAR points out, and steps are never shorter than
+// VIEWSTEP points
+#define VIEWNEAR 0.5
+#define VIEWSTEP 0.25
+
+#define MAXVIEWLEVELS 16
+
+double viewX, viewY, viewAlt, viewHeading, viewPitch;
+double viewFov = VIEWFOV;
+int    viewWidth = VIEWWIDTH, viewHeight = VIEWHEIGHT;
+
+// Level l of the pyramid holds the highest Z of the cells in each square of
+// 2^l by 2^l cells
+uchar *viewMax[MAXVIEWLEVELS];
+int   viewSize[MAXVIEWLEVELS];
+int   numViewLevels;
+
+uchar viewSky[2][3] = {
+  {200, 215, 230},   // At the horizon
+  {110, 150, 200}    // At the top of the picture
+};
+
+typedef struct {
+  double camX, camY, camH;   // In points
+  double forward[2], right[2];
+  double focal, horizon;     // In pixels
+  uchar  *colors;            // The shaded map
+  uchar  *sky;               // The sky color of each row
+  uchar  *frame;
+  int    nextBand;
+} viewJob;
+
+static INLINE double ViewHeight(int x, int y)
+{
+  return land[y][x].used ? land[y][x].z / 12.0 : 0.0;
+}
+
+// Builds the pyramid.  Cells with unused corners are never drawn, so they
+// count as 0.  Returns 0 if out of memory.
+int BuildViewPyramid()
+{
+  int   size, halfSize, l, x, y, n;
+  uchar *level, *half;
+
+  size = LANDSIZE - 1;
+  level = (uchar *)malloc(size * size);
+  if (level == NULL)
+    return 0;
+  for (y = 0; y < size; y++) {
+    for (x = 0; x < size; x++) {
+      n = land[y][x].z;
+      if (land[y][x + 1].z > n)
+        n = land[y][x + 1].z;
+      if (land[y + 1][x].z > n)
+        n = land[y + 1][x].z;
+      if (land[y + 1][x + 1].z > n)
+        n = land[y + 1][x + 1].z;
+      if (!land[y][x].used || !land[y][x + 1].used || !land[y + 1][x].used || !land[y + 1][x + 1].used)
+        n = 0;
+      level[y * size + x] = n;
+    }
+  }
+
+  for (l = 0; ; l++) {
+    viewMax[l] = level;
+    viewSize[l] = size;
+    if ((size == 1) || (l == MAXVIEWLEVELS - 1))
+      break;
+    halfSize = (size + 1) / 2;
+    half = (uchar *)malloc(halfSize * halfSize);
+    if (half == NULL)
+      return 0;
+    for (y = 0; y < halfSize; y++) {
+      for (x = 0; x < halfSize; x++) {
+        n = level[(2 * y) * size + 2 * x];
+        if ((2 * x + 1 < size) && (level[(2 * y) * size + 2 * x + 1] > n))
+          n = level[(2 * y) * size + 2 * x + 1];
+        if ((2 * y + 1 < size) && (level[(2 * y + 1) * size + 2 * x] > n))
+          n = level[(2 * y + 1) * size + 2 * x];
+        if ((2 * x + 1 < size) && (2 * y + 1 < size) && (level[(2 * y + 1) * size + 2 * x + 1] > n))
+          n = level[(2 * y + 1) * size + 2 * x + 1];
+        half[y * halfSize + x] = n;
+      }
+    }
+    level = half;
+    size = halfSize;
+  }
+  numViewLevels = l + 1;
+  return 1;
+}
+
+// Draws column sx of the view
+void ViewColumn(viewJob *job, int sx)
+{
+  double dx, dy, d, dNear, dFar, dExit, t0, t1, px, py, fx, fy, h, h00, h01, h10, h11, thr, top;
+  double c[3];
+  uchar  *out, *p00, *p01, *p10, *p11;
+  int    yBuf, level, ix, iy, x0, y0, size, row, i;
+
+  t0 = (sx + 0.5 - viewWidth / 2.0) / job->focal;
+  dx = job->forward[0] + job->right[0] * t0;
+  dy = job->forward[1] + job->right[1] * t0;
+
+  // Clip the ray to the cells of the map
+  dNear = VIEWNEAR;
+  dFar = 1e30;
+  if (dx != 0.0) {
+    t0 = -job->camX / dx;
+    t1 = (LANDSIZE - 1 - job->camX) / dx;
+    if (t0 > t1) {
+      d = t0;
+      t0 = t1;
+      t1 = d;
+    }
+    if (t0 > dNear)
+      dNear = t0;
+    if (t1 < dFar)
+      dFar = t1;
+  }
+  else if ((job->camX < 0.0) || (job->camX >= LANDSIZE - 1))
+    dFar = 0.0;
+  if (dy != 0.0) {
+    t0 = -job->camY / dy;
+    t1 = (LANDSIZE - 1 - job->camY) / dy;
+    if (t0 > t1) {
+      d = t0;
+      t0 = t1;
+      t1 = d;
+    }
+    if (t0 > dNear)
+      dNear = t0;
+    if (t1 < dFar)
+      dFar = t1;
+  }
+  else if ((job->camY < 0.0) || (job->camY >= LANDSIZE - 1))
+    dFar = 0.0;
+
+  yBuf = viewHeight;
+  level = 0;
+  d = dNear;
+  while ((d < dFar) && (yBuf > 0)) {
+    px = job->camX + dx * d;
+    py = job->camY + dy * d;
+    ix = (int)px;
+    iy = (int)py;
+    if (ix > LANDSIZE - 2)
+      ix = LANDSIZE - 2;
+    if (iy > LANDSIZE - 2)
+      iy = LANDSIZE - 2;
+
+    // Where the ray leaves the square of this level it is in
+    size = 1 << level;
+    x0 = (ix >> level) << level;
+    y0 = (iy >> level) << level;
+    dExit = dFar;
+    if (dx > 0.0)
+      dExit = (x0 + size - job->camX) / dx;
+    else if (dx < 0.0)
+      dExit = (x0 - job->camX) / dx;
+    if (dy > 0.0)
+      t0 = (y0 + size - job->camY) / dy;
+    else if (dy < 0.0)
+      t0 = (y0 - job->camY) / dy;
+    else
+      t0 = dFar;
+    if (t0 < dExit)
+      dExit = t0;
+    if (dExit > dFar)
+      dExit = dFar;
+
+    // Land lower than thr anywhere along the way cannot show
+    thr = job->camH - (yBuf - job->horizon) * d / job->focal;
+    t1 = job->camH - (yBuf - job->horizon) * dExit / job->focal;
+    if (t1 < thr)
+      thr = t1;
+    if (viewMax[level][(iy >> level) * viewSize[level] + (ix >> level)] / 12.0 <= thr) {
+      d = dExit * (1.0 + 1e-9) + 1e-9;
+      if (level < numViewLevels - 1)
+        level++;
+      continue;
+    }
+    if (level > 0) {
+      level--;
+      continue;
+    }
+
+    // Cells with unused corners are left empty
+    if (!land[iy][ix].used || !land[iy][ix + 1].used || !land[iy + 1][ix].used || !land[iy + 1][ix + 1].used) {
+      d = dExit * (1.0 + 1e-9) + 1e-9;
+      continue;
+    }
+
+    // Sample the cell the whole way across before looking at the pyramid again
+    h00 = ViewHeight(ix, iy);
+    h01 = ViewHeight(ix + 1, iy);
+    h10 = ViewHeight(ix, iy + 1);
+    h11 = ViewHeight(ix + 1, iy + 1);
+    do {
+      fx = job->camX + dx * d - ix;
+      fy = job->camY + dy * d - iy;
+      fx = (fx < 0.0) ? 0.0 : ((fx > 1.0) ? 1.0 : fx);
+      fy = (fy < 0.0) ? 0.0 : ((fy > 1.0) ? 1.0 : fy);
+      h = (h00 * (1.0 - fx) + h01 * fx) * (1.0 - fy) + (h10 * (1.0 - fx) + h11 * fx) * fy;
+      top = job->horizon + job->focal * (job->camH - h) / d;
+      if (top < yBuf) {
+        p00 = &job->colors[(iy * LANDSIZE + ix) * 3];
+        p01 = p00 + 3;
+        p10 = p00 + LANDSIZE * 3;
+        p11 = p10 + 3;
+        for (i = 0; i < 3; i++)
+          c[i] = (p00[i] * (1.0 - fx) + p01[i] * fx) * (1.0 - fy) + (p10[i] * (1.0 - fx) + p11[i] * fx) * fy + 0.5;
+        row = (top <= 0.0) ? 0 : (int)ceil(top);
+        while (yBuf > row) {
+          yBuf--;
+          out = &job->frame[((long)yBuf * viewWidth + sx) * 3];
+          out[0] = (uchar)c[0];
+          out[1] = (uchar)c[1];
+          out[2] = (uchar)c[2];
+        }
+      }
+      d += (d / job->focal > VIEWSTEP) ? d / job->focal : VIEWSTEP;
+    } while ((d < dExit) && (yBuf > 0));
+  }
+
+  // The rest of the column is sky
+  for (row = 0; row < yBuf; row++)
+    memcpy(&job->frame[((long)row * viewWidth + sx) * 3], &job->sky[row * 3], 3);
+}
+
+void ViewBands(void *ctx)
+{
+  viewJob *job = (viewJob *)ctx;
+  int     firstX, x, endX;
+
+  while ((firstX = AtomicAdd(&job->nextBand, 1) * BANDROWS) < viewWidth) {
+    endX = (firstX + BANDROWS < viewWidth) ? firstX + BANDROWS : viewWidth;
+    for (x = firstX; x < endX; x++)
+      ViewColumn(job, x);
+  }
+}
+
+// Shades the map and writes the view of it
+int WriteView(shadeFunc shade, char *fileName)
+{
+  viewJob     job;
+  imageWriter image;
+  double      heading, t;
+  int         row, i;
+
+  job.colors = (uchar *)malloc((long)LANDSIZE * LANDSIZE * 3);
+  job.frame = (uchar *)malloc((long)viewWidth * viewHeight * 3);
+  job.sky = (uchar *)malloc(viewHeight * 3);
+  if ((job.colors == NULL) || (job.frame == NULL) || (job.sky == NULL) || !BuildViewPyramid()) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  ShadeRows(shade, job.colors, NULL, 0, LANDSIZE, numMarks > 0);
+
+  heading = viewHeading * 3.14159265358979 / 180.0;
+  job.camX = viewX;
+  job.camY = viewY;
+  job.camH = viewAlt / 24.0;
+  job.forward[0] = sin(heading);
+  job.forward[1] = -cos(heading);
+  job.right[0] = cos(heading);
+  job.right[1] = sin(heading);
+  job.focal = viewWidth / 2.0 / tan(viewFov * 3.14159265358979 / 360.0);
+  job.horizon = viewHeight / 2.0 - job.focal * tan(viewPitch * 3.14159265358979 / 180.0);
+  for (row = 0; row < viewHeight; row++) {
+    t = (job.horizon - row) / (viewHeight / 2.0);
+    if (t < 0.0)
+      t = 0.0;
+    if (t > 1.0)
+      t = 1.0;
+    for (i = 0; i < 3; i++)
+      job.sky[row * 3 + i] = (uchar)(viewSky[0][i] + (viewSky[1][i] - viewSky[0][i]) * t + 0.5);
+  }
+
+  job.nextBand = 0;
+  RunJob(ViewBands, &job);
+
+  if (!ImageOpen(&image, fileName, viewWidth, viewHeight, 3))
+    return -1;
+  ImageWriteRows(&image, job.frame, viewHeight);
+  ImageClose(&image);
+
+  free(job.colors);
+  free(job.frame);
+  free(job.sky);
+  for (i = 0; i < numViewLevels; i++)
+    free(viewMax[i]);
+  return 0;
+}
+
+// Isometric posters
+//
+// -iso <SCALE> draws the whole map in the classic isometric style, looking
+// north from above the south corner with every cell a diamond 2 * SCALE pixels
+// wide and SCALE high.  Heights are drawn true to the ground, or -relief times
+// as tall.  Even a small scale makes a big picture (SCALE 8 is over half a
+// gigapixel), so it is rendered and written a strip of ISOTILE rows at a
+// time, and each strip is cut into tiles ISOTILE pixels wide which are handed
+// out to the threads.  Only the strip, the shaded map and the pyramid are
+// ever held.
+//
+// Each column of pixels looks down one diagonal of the map, so the tiles are
+// drawn like the views above: a column walks its diagonal from the front of
+// the map to the back, draws land up from where it lands to the highest pixel
+// drawn so far, and stops once its part of the tile is full.  The walk starts
+// as far forward as any land could reach up into the tile from, and the max
+// pyramid from the views lets it jump over land that cannot show.  Where land
+// begins, at the front edges of the map or behind unused points, there is
+// nothing below it to draw up from, so it stands on a darker wall down to
+// height 0 instead.
+
+#define ISOTILE     128
+#define MAXISOSCALE 16
+#define ISOWALL     0.6
+
+uchar isoBackground[3] = {255, 255, 255};
+
+double isoRelief = 1.0;
+
+typedef struct {
+  int    scale;
+  double rise;      // Pixels up for a point of height
+  int    top;       // Rows above the back corner for the highest land
+  int    width, height;
+  uchar  *colors;   // The shaded map
+  uchar  *strip;
+  int    firstY, numRows;
+  int    nextTile;
+} isoJob;
+
+// Draws rows firstY up to endY of pixel column px into the strip, which holds
+// the rows from job->firstY on
+void IsoColumn(isoJob *job, int px, int firstY, int endY)
+{
+  double u, v, vMin, vExit, x, y, fx, fy, h, h00, h01, h10, h11, top, base, step, shade, c[3];
+  uchar  *out, *p00, *p01, *p10, *p11;
+  int    yBuf, level, ix, iy, x0, y0, row, onLand, i;
+
+  // The diagonal x - y = u, from the front (v = x + y large) to the back
+  u = (px + 0.5) / job->scale - (LANDSIZE - 1);
+  vMin = fabs(u);
+  v = 2 * (LANDSIZE - 1) - vMin;
+  x = (endY - job->top + viewMax[numViewLevels - 1][0] / 12.0 * job->rise) * 2.0 / job->scale;
+
+  // Starting behind the front edge, the land in front is all below the tile
+  onLand = (x < v);
+  if (onLand)
+    v = x;
+  step = 1.0 / job->scale;
+
+  yBuf = endY;
+  level = 0;
+  while ((v >= vMin) && (yBuf > firstY)) {
+    x = (u + v) / 2.0;
+    y = (v - u) / 2.0;
+    ix = (x < 0.0) ? 0 : ((x > LANDSIZE - 2) ? LANDSIZE - 2 : (int)x);
+    iy = (y < 0.0) ? 0 : ((y > LANDSIZE - 2) ? LANDSIZE - 2 : (int)y);
+
+    // Where the walk leaves the square of this level it is in
+    x0 = (ix >> level) << level;
+    y0 = (iy >> level) << level;
+    vExit = (2 * x0 - u > 2 * y0 + u) ? 2 * x0 - u : 2 * y0 + u;
+
+    // Even the highest land in the square would land below yBuf
+    if (job->top + vExit * job->scale / 2.0 - viewMax[level][(iy >> level) * viewSize[level] + (ix >> level)] /
+        12.0 * job->rise >= yBuf) {
+      v = vExit - 1e-9 * (1.0 + vExit);
+      if (level < numViewLevels - 1)
+        level++;
+      continue;
+    }
+    if (level > 0) {
+      level--;
+      continue;
+    }
+
+    // Cells with unused corners are left empty
+    if (!land[iy][ix].used || !land[iy][ix + 1].used || !land[iy + 1][ix].used || !land[iy + 1][ix + 1].used) {
+      v = vExit - 1e-9 * (1.0 + vExit);
+      onLand = 0;
+      continue;
+    }
+
+    h00 = ViewHeight(ix, iy);
+    h01 = ViewHeight(ix + 1, iy);
+    h10 = ViewHeight(ix, iy + 1);
+    h11 = ViewHeight(ix + 1, iy + 1);
+    p00 = &job->colors[(iy * LANDSIZE + ix) * 3];
+    p01 = p00 + 3;
+    p10 = p00 + LANDSIZE * 3;
+    p11 = p10 + 3;
+    do {
+      fx = (u + v) / 2.0 - ix;
+      fy = (v - u) / 2.0 - iy;
+      fx = (fx < 0.0) ? 0.0 : ((fx > 1.0) ? 1.0 : fx);
+      fy = (fy < 0.0) ? 0.0 : ((fy > 1.0) ? 1.0 : fy);
+      h = (h00 * (1.0 - fx) + h01 * fx) * (1.0 - fy) + (h10 * (1.0 - fx) + h11 * fx) * fy;
+      top = job->top + v * job->scale / 2.0 - h * job->rise;
+      if (!onLand) {
+        // The rows below the wall show the background
+        base = ceil(job->top + v * job->scale / 2.0);
+        for (; (yBuf > base) && (yBuf > firstY); yBuf--)
+          memcpy(&job->strip[((long)(yBuf - 1 - job->firstY) * job->width + px) * 3], isoBackground, 3);
+      }
+      if (top < yBuf) {
+        shade = onLand ? 1.0 : ISOWALL;
+        for (i = 0; i < 3; i++)
+          c[i] = ((p00[i] * (1.0 - fx) + p01[i] * fx) * (1.0 - fy) + (p10[i] * (1.0 - fx) + p11[i] * fx) * fy) * shade + 0.5;
+        row = (top <= firstY) ? firstY : (int)ceil(top);
+        while (yBuf > row) {
+          yBuf--;
+          out = &job->strip[((long)(yBuf - job->firstY) * job->width + px) * 3];
+          out[0] = (uchar)c[0];
+          out[1] = (uchar)c[1];
+          out[2] = (uchar)c[2];
+        }
+      }
+      onLand = 1;
+      v -= step;
+    } while ((v > vExit) && (v >= vMin) && (yBuf > firstY));
+  }
+
+  for (row = firstY; row < yBuf; row++)
+    memcpy(&job->strip[((long)(row - job->firstY) * job->width + px) * 3], isoBackground, 3);
+}
+
+void IsoTiles(void *ctx)
+{
+  isoJob *job = (isoJob *)ctx;
+  int    firstX, endX, x;
+
+  while ((firstX = AtomicAdd(&job->nextTile, 1) * ISOTILE) < job->width) {
+    endX = (firstX + ISOTILE < job->width) ? firstX + ISOTILE : job->width;
+    for (x = firstX; x < endX; x++)
+      IsoColumn(job, x, job->firstY, job->firstY + job->numRows);
+  }
+}
+
+// Shades the map and writes the isometric picture of it
+int WriteIso(shadeFunc shade, char *fileName, int scale)
+{
+  isoJob      job;
+  imageWriter image;
+  int         i;
+
+  job.colors = (uchar *)malloc((long)LANDSIZE * LANDSIZE * 3);
+  if ((job.colors == NULL) || !BuildViewPyramid()) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  ShadeRows(shade, job.colors, NULL, 0, LANDSIZE, numMarks > 0);
+
+  // A cell is 2 * scale by scale.  Seen from 30 degrees up, a height the size
+  // of a point rises sqrt(1.5) * scale.
+  job.scale = scale;
+  job.rise = sqrt(1.5) * scale * isoRelief;
+  job.top = (int)ceil(viewMax[numViewLevels - 1][0] / 12.0 * job.rise);
+  job.width = 2 * (LANDSIZE - 1) * scale;
+  job.height = job.top + (LANDSIZE - 1) * scale;
+  job.strip = (uchar *)malloc((long)ISOTILE * job.width * 3);
+  if (job.strip == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  if (!ImageOpen(&image, fileName, job.width, job.height, 3))
+    return -1;
+  printf("Drawing a %d by %d picture.\n", job.width, job.height);
+
+  for (job.firstY = 0; job.firstY < job.height; job.firstY += ISOTILE) {
+    job.numRows = (job.height - job.firstY < ISOTILE) ? job.height - job.firstY : ISOTILE;
+    job.nextTile = 0;
+    RunJob(IsoTiles, &job);
+    ImageWriteRows(&image, job.strip, job.numRows);
+  }
+  ImageClose(&image);
+
+  free(job.colors);
+  free(job.strip);
+  for (i = 0; i < numViewLevels; i++)
+    free(viewMax[i]);
+  return 0;
+}
+
+// Reading cell.dat
+//
+// -cell shades the picture straight from cell.dat (see mapac.c for its
+// format), with no map file in between.  A reader thread first walks the
+// directory for where each landblock is.  The ids put the landblocks in order
+// from west to east, but the picture is written from north to south, so the
+// reader then reads them a row of landblocks at a time from the north.  It
+// hands them to the main thread through a queue of CELLQUEUE landblocks, and
+// waits whenever the queue is full.  The main thread writes them into the map
+// and shades each group of rows as soon as the landblocks under those rows,
+// and under the row below them, have all arrived, so reading and shading
+// overlap.  The points shared by two landblocks are kept from the one mapac
+// would have written last, going through the directory, so the picture is the
+// same as from a new map made from the same cell.dat.  Landblocks not in
+// cell.dat are unused, so green.
+// Shadows and ambient occlusion need the whole map before the first row is
+// shaded, so they cannot be used with -cell.
+
+#define CELLSECSIZE 64
+#define CELLQUEUE   256
+
+typedef struct {
+  int    blockX, blockY;
+  ushort type[81];
+  uchar  z[81];
+} cellBlock;
+
+typedef struct {
+  char      *fileName;
+  uint      blockPos[255][255];
+  int       blockOrder[255][255];
+  int       numFound;
+  cellBlock queue[CELLQUEUE];
+  int       head, count;
+  int       done, failed;
+  mutex     lock;
+  condition notEmpty, notFull;
+  int       blockY, readyRows, numBlocks;
+} cellReader;
+
+cellReader cell;
+
+// Finds the landblocks in a directory of cell.dat, and those under it
+int CellDir(FILE *cellFile, uint dirPos)
+{
+  uint dir[4 * CELLSECSIZE];
+  uint numFiles, id, i;
+  int  n;
+
+  // A directory takes up to four sectors, each after the first starting with
+  // the pointer to the next
+  if ((fseek(cellFile, dirPos, SEEK_SET) != 0) || (fread(dir, sizeof(uint), CELLSECSIZE, cellFile) != CELLSECSIZE)) {
+    printf("ERROR: Directory at %08X could not be read!\n", dirPos);
+    return 0;
+  }
+  dirPos = dir[0];
+  for (n = 1; (n < 4) && (dirPos != 0); n++) {
+    if ((fseek(cellFile, dirPos, SEEK_SET) != 0) || (fread(&dirPos, sizeof(uint), 1, cellFile) != 1) ||
+        (fread(&dir[CELLSECSIZE * n - (n - 1)], sizeof(uint), CELLSECSIZE - 1, cellFile) != CELLSECSIZE - 1)) {
+      printf("ERROR: Directory could not be read!\n");
+      return 0;
+    }
+  }
+
+  numFiles = dir[NUMFILELOC];
+  if (numFiles >= NUMFILELOC) {
+    printf("ERROR: Number of files exceeds directory entries!\n");
+    return 0;
+  }
+  for (i = 0; i < numFiles; i++) {
+    id = dir[i * 3 + NUMFILELOC + 1];
+    if (((id & 0x0000FFFF) == 0x0000FFFF) && ((id >> 24) < 255) && (((id >> 16) & 0xFF) < 255)) {
+      cell.blockPos[id >> 24][(id >> 16) & 0xFF] = dir[i * 3 + NUMFILELOC + 2];
+      cell.blockOrder[id >> 24][(id >> 16) & 0xFF] = ++cell.numFound;
+    }
+  }
+
+  if (dir[1] != 0) {
+    for (i = 0; i <= numFiles; i++) {
+      if (!CellDir(cellFile, dir[i + 1]))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+#ifdef _WIN32
+DWORD WINAPI CellRead(LPVOID arg)
+#else
+void *CellRead(void *arg)
+#endif
+{
+  FILE      *cellFile;
+  uint      rootDirPtr, sec[CELLSECSIZE];
+  cellBlock *block;
+  int       x, y, ok;
+
+  (void)arg;
+  ok = 0;
+  cellFile = fopen(cell.fileName, "rb");
+  if (cellFile == NULL)
+    printf("ERROR: File %s could not be opened!\n", cell.fileName);
+  else if ((fseek(cellFile, ROOTDIRPTRLOC, SEEK_SET) != 0) || (fread(&rootDirPtr, sizeof(uint), 1, cellFile) != 1))
+    printf("ERROR: File %s is not a cell.dat!\n", cell.fileName);
+  else
+    ok = CellDir(cellFile, rootDirPtr);
+
+  for (y = 254; ok && (y >= 0); y--) {
+    for (x = 0; ok && (x < 255); x++) {
+      if (cell.blockPos[x][y] == 0)
+        continue;
+      if ((fseek(cellFile, cell.blockPos[x][y], SEEK_SET) != 0) ||
+          (fread(sec, sizeof(uint), CELLSECSIZE, cellFile) != CELLSECSIZE) || (sec[1] >> 16 != (uint)(x << 8 | y))) {
+        printf("ERROR: Land block %02X%02XFFFF could not be read!\n", x, y);
+        ok = 0;
+        break;
+      }
+
+      MutexLock(&cell.lock);
+      while (cell.count == CELLQUEUE)
+        CondWait(&cell.notFull, &cell.lock);
+      MutexUnlock(&cell.lock);
+
+      // Only the reader adds to the queue, so the free slot stays free
+      block = &cell.queue[(cell.head + cell.count) % CELLQUEUE];
+      block->blockX = x;
+      block->blockY = y;
+      memcpy(block->type, &((uchar *)sec)[12], sizeof(block->type));
+      memcpy(block->z, &((uchar *)sec)[174], sizeof(block->z));
+
+      MutexLock(&cell.lock);
+      cell.count++;
+      CondBroadcast(&cell.notEmpty);
+      MutexUnlock(&cell.lock);
+    }
+  }
+  if (cellFile != NULL)
+    fclose(cellFile);
+
+  MutexLock(&cell.lock);
+  cell.failed = !ok;
+  cell.done = 1;
+  CondBroadcast(&cell.notEmpty);
+  MutexUnlock(&cell.lock);
+  return 0;
+}
+
+// Starts reading landblocks from cell.dat.  Returns 0 if the reader thread
+// could not be started.
+int StartCell(char *fileName)
+{
+#ifdef _WIN32
+  HANDLE    handle;
+#else
+  pthread_t handle;
+#endif
+
+  cell.fileName = fileName;
+  cell.head = 0;
+  cell.count = 0;
+  cell.done = 0;
+  cell.failed = 0;
+  cell.blockY = 255;
+  cell.readyRows = 0;
+  cell.numBlocks = 0;
+  cell.numFound = 0;
+  MutexInit(&cell.lock);
+  CondInit(&cell.notEmpty);
+  CondInit(&cell.notFull);
+
+#ifdef _WIN32
+  handle = CreateThread(NULL, 0, CellRead, NULL, 0, NULL);
+  if (handle == NULL) {
+    printf("ERROR: The cell.dat reader could not be started!\n");
+    return 0;
+  }
+  CloseHandle(handle);
+#else
+  if (pthread_create(&handle, NULL, CellRead, NULL) != 0) {
+    printf("ERROR: The cell.dat reader could not be started!\n");
+    return 0;
+  }
+  pthread_detach(handle);
+#endif
+  return 1;
+}
+
+// Returns 1 if, of the landblocks holding the point (x, y), the one at
+// (blockX, blockY) comes last in the directory
+static int CellOwns(int blockX, int blockY, int x, int y)
+{
+  int bx, by, row;
+
+  row = LANDSIZE - 1 - y;
+  for (bx = (x - 1) / 8; bx <= x / 8; bx++) {
+    for (by = (row - 1) / 8; by <= row / 8; by++) {
+      if ((bx < 255) && (by < 255) && (cell.blockOrder[bx][by] > cell.blockOrder[blockX][blockY]))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Writes landblocks from the queue into the map until rows up to endY, and
+// the row after them, are all there.  Returns 0 if cell.dat could not be read.
+int CellRows(int endY)
+{
+  cellBlock *block;
+  landData  *point;
+  int       startX, startY, x, y;
+
+  while (cell.readyRows < endY) {
+    MutexLock(&cell.lock);
+    while ((cell.count == 0) && !cell.done)
+      CondWait(&cell.notEmpty, &cell.lock);
+    if (cell.count == 0) {
+      MutexUnlock(&cell.lock);
+      if (cell.failed)
+        return 0;
+      cell.readyRows = LANDSIZE;
+      printf("Total land blocks found: %d\n", cell.numBlocks);
+      break;
+    }
+    block = &cell.queue[cell.head];
+    MutexUnlock(&cell.lock);
+
+    // The first landblock of a row further south means every row above it
+    // is done, except the row shared with it
+    if (block->blockY < cell.blockY) {
+      cell.blockY = block->blockY;
+      cell.readyRows = LANDSIZE - 2 - (cell.blockY + 1) * 8;
+    }
+
+    // Points on the edges are shared with other landblocks
+    startX = block->blockX * 8;
+    startY = LANDSIZE - block->blockY * 8 - 1;
+    for (x = 0; x < 9; x++) {
+      for (y = 0; y < 9; y++) {
+        point = &land[startY - y][startX + x];
+        if (((x == 0) || (x == 8) || (y == 0) || (y == 8)) &&
+            !CellOwns(block->blockX, block->blockY, startX + x, startY - y))
+          continue;
+        point->type = block->type[x * 9 + y];
+        point->z = block->z[x * 9 + y];
+        point->used = 1;
+      }
+    }
+    cell.numBlocks++;
+
+    MutexLock(&cell.lock);
+    cell.head = (cell.head + 1) % CELLQUEUE;
+    cell.count--;
+    CondBroadcast(&cell.notFull);
+    MutexUnlock(&cell.lock);
+  }
+  return 1;
+}
+
+// Land types
+//
+// -types writes the land type of each point instead of shading the map, as an
+// 8 bit picture: LandType() (roads are 32), or TYPEUNUSED where the map has no
+// data.  A PNG gets a palette of the base land colors before any lighting,
+// with unused points green as in the shaded picture, so it can be viewed as
+// is; a RAW picture is just the indices.  Either is a third the size
+// of the shaded picture.  The types come straight from the map with SSE2, 16
+// points at a time: the four bytes of a point are one 32 bit lane.
+
+#define TYPEUNUSED 33
+
+// Writes the land types of width points of a row into out
+void TypeRow(landData *row, uchar *out, int width)
+{
+  int     x;
+#if SIMDWIDTH > 1
+  __m128i p[4], typeMask, roadMask, road, unused, zero, t, isRoad, isUnused;
+  int     i;
+
+  typeMask = _mm_set1_epi32(0xFC);
+  roadMask = _mm_set1_epi32(0x03);
+  road = _mm_set1_epi32(32);
+  unused = _mm_set1_epi32(TYPEUNUSED);
+  zero = _mm_setzero_si128();
+  for (x = 0; x + 16 <= width; x += 16) {
+    for (i = 0; i < 4; i++) {
+      p[i] = _mm_loadu_si128((__m128i *)&row[x + i * 4]);
+      t = _mm_srli_epi32(_mm_and_si128(p[i], typeMask), 2);
+      isRoad = _mm_cmpeq_epi32(_mm_and_si128(p[i], roadMask), zero);
+      t = _mm_or_si128(_mm_and_si128(isRoad, t), _mm_andnot_si128(isRoad, road));
+      isUnused = _mm_cmpeq_epi32(_mm_srli_epi32(p[i], 24), zero);
+      p[i] = _mm_or_si128(_mm_andnot_si128(isUnused, t), _mm_and_si128(isUnused, unused));
+    }
+    _mm_storeu_si128((__m128i *)&out[x], _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]), _mm_packs_epi32(p[2], p[3])));
+  }
+#else
+  x = 0;
+#endif
+  for (; x < width; x++)
+    out[x] = row[x].used ? (uchar)LandType(&row[x]) : TYPEUNUSED;
+}
+
+// Writes the land types of the region
+int WriteTypes(char *fileName, int fromCell)
+{
+  imageWriter image;
+  uchar       palette[(TYPEUNUSED + 1) * 3], *rows;
+  double      color;
+  int         width, groupRows, numRows, type, y, i;
+
+  for (type = 0; type < TYPEUNUSED; type++) {
+    for (i = 0; i < 3; i++) {
+      color = lights.landColor[type][i] * lights.colorCorrection / lights.landColor[type][3];
+      palette[type * 3 + i] = (color > 255.0) ? 255 : (uchar)color;
+    }
+  }
+  palette[TYPEUNUSED * 3] = 0;
+  palette[TYPEUNUSED * 3 + 1] = 0xFF;
+  palette[TYPEUNUSED * 3 + 2] = 0;
+
+  // A few bands for each thread at a time, so the PNG is compressed on all of
+  // them
+  width = regionX1 - regionX0 + 1;
+  groupRows = 2 * numThreads * BANDROWS;
+  rows = (uchar *)malloc(groupRows * width);
+  if (rows == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  if (!ImageOpenIndexed(&image, fileName, width, regionY1 - regionY0 + 1, palette, TYPEUNUSED + 1))
+    return -1;
+
+  for (y = regionY0; y <= regionY1; y += numRows) {
+    numRows = (regionY1 + 1 - y < groupRows) ? regionY1 + 1 - y : groupRows;
+    if (fromCell && !CellRows(y + numRows))
+      return -1;
+    for (i = 0; i < numRows; i++)
+      TypeRow(&land[y + i][regionX0], &rows[i * width], width);
+    ImageWriteRows(&image, rows, numRows);
+  }
+  ImageClose(&image);
+  free(rows);
+  return 0;
+}
+
+// Configuration
+//
+// -config reads settings from a text file, one per line; lines starting with
+// # are comments.  -set gives a single setting on the command line, and is
+// applied after any -config that comes before it.  The settings are:
+//    lightvector <X> <Y> <Z>
+//    colorcorrection <C>
+//    lightcorrection <C>
+//    ambientlight <A>
+//    landcolor <TYPE 0-32> <RED 0-255> <GREEN 0-255> <BLUE 0-255> <CONTROL 1-255>
+//    direction <X> <Y> <Z> <WEIGHT>
+//    shadow <ELEVATION> <STRENGTH 0-1>
+//    occlusion <DIRECTIONS> <RADIUS> <STRENGTH 0-1>
+//    texture <TYPE 0-32> <TEXTURE ID, e.g. 0x05001234>
+//    texturesize <POINTS>
+//    vegetation <STRENGTH 0-1>
+// Each direction setting adds a light for multi-directional shading, up to
+// MAXDIRECTIONS of them.  -multi adds the four directions in multiDirections.
+// shadow casts shadows from a sun ELEVATION degrees up (see Shadows above).
+// occlusion darkens points that cannot see much of the sky, looking RADIUS
+// points out in DIRECTIONS directions (see Ambient occlusion above).  More of
+// either is slower but smoother.  texture draws a land type with a texture
+// from the PORTAL.DAT given with -portal (see Textures above).  vegetation
+// tints the map by vegetation class (see Vegetation above).
+
+// The sun 30 degrees up in the west, northwest, north and southwest, with the
+// northwest light counting double like the default light
+double multiDirections[4][4] = {
+  {-0.866, 0.0, 0.5, 1.0},
+  {-0.612, -0.612, 0.5, 2.0},
+  {0.0, -0.866, 0.5, 1.0},
+  {-0.612, 0.612, 0.5, 1.0}
+};
+
+// Applies one setting to lt.  Returns 0 if the setting is not understood.
+int ApplySetting(lighting *lt, char *setting)
+{
+  char   name[64];
+  double x, y, z, w;
+  int    type, r, g, b, control;
+
+  if ((sscanf(setting, "%63s", name) != 1) || (name[0] == '#'))
+    return 1;
+
+  if (!strcmp(name, "lightvector") && (sscanf(setting, "%*s %lf %lf %lf", &x, &y, &z) == 3)) {
+    if ((x == 0.0) && (y == 0.0) && (z == 0.0))
+      return 0;
+    lt->lightVector[0] = x;
+    lt->lightVector[1] = y;
+    lt->lightVector[2] = z;
+  }
+  else if (!strcmp(name, "colorcorrection") && (sscanf(setting, "%*s %lf", &x) == 1))
+    lt->colorCorrection = x;
+  else if (!strcmp(name, "lightcorrection") && (sscanf(setting, "%*s %lf", &x) == 1))
+    lt->lightCorrection = x;
+  else if (!strcmp(name, "ambientlight") && (sscanf(setting, "%*s %lf", &x) == 1))
+    lt->ambientLight = x;
+  else if (!strcmp(name, "direction") && (sscanf(setting, "%*s %lf %lf %lf %lf", &x, &y, &z, &w) == 4)) {
+    if ((lt->numDirections == MAXDIRECTIONS) || ((x == 0.0) && (y == 0.0) && (z == 0.0)) || (w <= 0.0))
+      return 0;
+    lt->direction[lt->numDirections][0] = x;
+    lt->direction[lt->numDirections][1] = y;
+    lt->direction[lt->numDirections][2] = z;
+    lt->direction[lt->numDirections][3] = w;
+    lt->numDirections++;
+  }
+  else if (!strcmp(name, "shadow") && (sscanf(setting, "%*s %lf %lf", &x, &y) == 2)) {
+    if ((x <= 0.0) || (x >= 90.0) || (y < 0.0) || (y > 1.0))
+      return 0;
+    lt->shadowElevation = x;
+    lt->shadowStrength = y;
+  }
+  else if (!strcmp(name, "occlusion") && (sscanf(setting, "%*s %d %d %lf", &r, &g, &x) == 3)) {
+    if ((r < 1) || (r > MAXOCCLUSIONDIRECTIONS) || (g < 1) || (g > MAXOCCLUSIONRADIUS) || (x < 0.0) || (x > 1.0))
+      return 0;
+    lt->occlusionDirections = r;
+    lt->occlusionRadius = g;
+    lt->occlusionStrength = x;
+  }
+  else if (!strcmp(name, "texture") && (sscanf(setting, "%*s %d %i", &type, &r) == 2)) {
+    if ((type < 0) || (type > 32))
+      return 0;
+    lt->texture[type] = (uint)r;
+  }
+  else if (!strcmp(name, "vegetation") && (sscanf(setting, "%*s %lf", &x) == 1)) {
+    if ((x < 0.0) || (x > 1.0))
+      return 0;
+    lt->vegetationStrength = x;
+  }
+  else if (!strcmp(name, "texturesize") && (sscanf(setting, "%*s %lf", &x) == 1)) {
+    if (x <= 0.0)
+      return 0;
+    lt->textureSize = x;
+  }
+  else if (!strcmp(name, "landcolor") &&
+      (sscanf(setting, "%*s %d %d %d %d %d", &type, &r, &g, &b, &control) == 5)) {
+    if ((type < 0) || (type > 32) || (r < 0) || (r > 255) || (g < 0) || (g > 255) || (b < 0) || (b > 255) ||
+        (control < 1) || (control > 255))
+      return 0;
+    lt->landColor[type][0] = r;
+    lt->landColor[type][1] = g;
+    lt->landColor[type][2] = b;
+    lt->landColor[type][3] = control;
+  }
+  else
+    return 0;
+
+  return 1;
+}
+
+int ReadConfig(lighting *lt, char *fileName)
+{
+  FILE *configFile;
+  char line[256];
+  int  lineNum;
+
+  configFile = fopen(fileName, "r");
+  if (configFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+
+  lineNum = 0;
+  while (fgets(line, sizeof(line), configFile) != NULL) {
+    lineNum++;
+    if (!ApplySetting(lt, line)) {
+      printf("ERROR: Line %d of %s is not a valid setting!\n", lineNum, fileName);
+      fclose(configFile);
+      return 0;
+    }
+  }
+  fclose(configFile);
+
+  return 1;
+}
+
+void PrintUsage()
+{
+  printf("usgae:\n");
+  printf("graphac [OPTIONS] <MAP FILE> <GRAPHICS FILE>\n");
+  printf("graphac -tiles [OPTIONS] <MAP FILE> <TILE DIRECTORY>\n");
+  printf("graphac -cell [OPTIONS] <CELL DATA FILE> <GRAPHICS FILE>\n");
+  printf("   A GRAPHICS FILE ending in .png is written as a PNG, otherwise as RAW.\n");
+  printf("   -threads <N>   Shade on N threads (default: one per processor)\n");
+  printf("   -config <FILE> Read lighting settings from FILE\n");
+  printf("   -set <SETTING> Change one lighting setting, e.g. -set \"ambientlight 80\"\n");
+  printf("   -multi         Light the map from four directions at once\n");
+  printf("   -simd          Use the single precision SIMD shading kernel\n");
+  printf("   -lut           Shade from precomputed lookup tables\n");
+  printf("   -verify        Also shade with the reference path and compare\n");
+  printf("   -maxzoom <Z>   Deepest zoom level for -tiles, %d to %d (default: %d)\n", TILEZOOM, MAXTILEZOOM,
+      TILEZOOM + 2);
+  printf("   -update        Redo only the land blocks in <MAP FILE>.dirty\n");
+  printf("   -scale <N>     Draw each square of the map N pixels across (up to %d)\n", MAXSCALE);
+  printf("   -mips          Also write the picture at 1024, 512, ... 1 pixels square\n");
+  printf("   -portal <FILE> Draw land types with their texture settings from PORTAL.DAT\n");
+  printf("   -vegetation <FILE> Also write the vegetation class and density of each point\n");
+  printf("   -objects <FILE> Draw the objects in FILE, which is <MAP FILE>.obj from mapac\n");
+  printf("   -cell          Shade straight from cell.dat, as mapac would read it into a new map\n");
+  printf("   -region <X0> <Y0> <X1> <Y1> Draw only the points from (X0, Y0) to (X1, Y1)\n");
+  printf("   -blocks <XXYY> <XXYY> Draw only the land blocks from one to the other\n");
+  printf("   -loc <NS> <EW> <NS> <EW> Draw only the /loc box, e.g. -loc 30.0N 40.0E 31.5N 42.0E\n");
+  printf("   -variant <CONFIG> <GRAPHICS FILE> Also write the map with the settings in CONFIG\n");
+  printf("   -normals       Keep the normals of the map in <MAP FILE>.nrm and shade from them\n");
+  printf("   -lowmem        Read the map three rows at a time and write each row at once\n");
+  printf("   -view <X> <Y> <ALT> <HEADING> <PITCH> Draw the land in perspective from point\n");
+  printf("                  (X, Y), ALT game units up, looking HEADING degrees clockwise\n");
+  printf("                  from north and PITCH degrees down\n");
+  printf("   -fov <DEGREES> How wide a view is (default: %.0f)\n", VIEWFOV);
+  printf("   -size <W> <H>  The size of a view in pixels (default: %d %d)\n", VIEWWIDTH, VIEWHEIGHT);
+  printf("   -types         Write the land type of each point, 0-31, roads 32 and unused %d,\n", TYPEUNUSED);
+  printf("                  as an 8 bit picture (a PNG gets a palette of the land colors)\n");
+  printf("   -iso <SCALE>   Draw the whole map as an isometric poster, each square a\n");
+  printf("                  diamond 2 * SCALE pixels wide (up to %d)\n", MAXISOSCALE);
+  printf("   -relief <N>    Draw heights in -iso N times as tall (default: 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  FILE        *mapFile;
+  imageWriter image;
+  shadeFunc   shade;
+  uchar       *rows, *ref;
+  int         argn;
+  int         verify, tolerance;
+  int         tiles, maxZoom, update, numDirty, scale, mips, fromCell, region, normals, lowMem, view, iso, types;
+  double      corner[8];
+  char        *portalName, *vegName, *objName;
+  char        *variantConfig[MAXVARIANTS];
+  imageWriter vegImage;
+  uchar       *vegRows;
+  int         y, numRows, groupRows, width, height;
+  int         i, diff, maxDiff;
+  long        numDiff;
+
+  numThreads = NumProcessors();
+  memcpy(&lights, &defaultLighting, sizeof(lighting));
+  shade = ShadeRow;
+  verify = 0;
+  tiles = 0;
+  maxZoom = TILEZOOM + 2;
+  update = 0;
+  scale = 1;
+  mips = 0;
+  fromCell = 0;
+  region = 0;
+  normals = 0;
+  lowMem = 0;
+  view = 0;
+  iso = 0;
+  types = 0;
+  numVariants = 1;
+  portalName = NULL;
+  vegName = NULL;
+  objName = NULL;
+
+  argn = 1;
+  while ((argn < argc) && (argv[argn][0] == '-')) {
+    if (!strcmp(argv[argn], "-threads") && (argn + 1 < argc)) {
+      numThreads = atoi(argv[argn + 1]);
+      if (numThreads < 1)
+        numThreads = 1;
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-config") && (argn + 1 < argc)) {
+      if (!ReadConfig(&lights, argv[argn + 1]))
+        return -1;
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-set") && (argn + 1 < argc)) {
+      if (!ApplySetting(&lights, argv[argn + 1])) {
+        printf("ERROR: %s is not a valid setting!\n", argv[argn + 1]);
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-multi")) {
+      for (i = 0; (i < 4) && (lights.numDirections < MAXDIRECTIONS); i++) {
+        memcpy(lights.direction[lights.numDirections], multiDirections[i], sizeof(multiDirections[i]));
+        lights.numDirections++;
+      }
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-simd")) {
+      shade = ShadeRowSIMD;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-lut")) {
+      shade = ShadeRowLUT;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-tiles")) {
+      tiles = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-cell")) {
+      fromCell = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-region") && (argn + 4 < argc)) {
+      if (!SetRegion(atof(argv[argn + 1]), atof(argv[argn + 2]), atof(argv[argn + 3]), atof(argv[argn + 4]))) {
+        printf("ERROR: The region is not on the map!\n");
+        return -1;
+      }
+      region = 1;
+      argn += 5;
+    }
+    else if (!strcmp(argv[argn], "-blocks") && (argn + 2 < argc)) {
+      if (!ParseBlock(argv[argn + 1], &corner[0], &corner[1], &corner[2], &corner[3]) ||
+          !ParseBlock(argv[argn + 2], &corner[4], &corner[5], &corner[6], &corner[7])) {
+        printf("ERROR: Land blocks must be given in hex, e.g. 7F7F!\n");
+        return -1;
+      }
+      SetRegion((corner[0] < corner[4]) ? corner[0] : corner[4], (corner[1] < corner[5]) ? corner[1] : corner[5],
+          (corner[2] > corner[6]) ? corner[2] : corner[6], (corner[3] > corner[7]) ? corner[3] : corner[7]);
+      region = 1;
+      argn += 3;
+    }
+    else if (!strcmp(argv[argn], "-loc") && (argn + 4 < argc)) {
+      if (!ParseLoc(argv[argn + 1], argv[argn + 2], &corner[0], &corner[1]) ||
+          !ParseLoc(argv[argn + 3], argv[argn + 4], &corner[2], &corner[3])) {
+        printf("ERROR: /loc coordinates must look like 42.1N 33.6E!\n");
+        return -1;
+      }
+      if (!SetRegion(corner[0], corner[1], corner[2], corner[3])) {
+        printf("ERROR: The region is not on the map!\n");
+        return -1;
+      }
+      region = 1;
+      argn += 5;
+    }
+    else if (!strcmp(argv[argn], "-variant") && (argn + 2 < argc)) {
+      if (numVariants > MAXVARIANTS) {
+        printf("ERROR: Only %d variants can be written at once!\n", MAXVARIANTS);
+        return -1;
+      }
+      variantConfig[numVariants - 1] = argv[argn + 1];
+      variants[numVariants].fileName = argv[argn + 2];
+      numVariants++;
+      argn += 3;
+    }
+    else if (!strcmp(argv[argn], "-normals")) {
+      normals = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-lowmem")) {
+      lowMem = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-view") && (argn + 5 < argc)) {
+      viewX = atof(argv[argn + 1]);
+      viewY = atof(argv[argn + 2]);
+      viewAlt = atof(argv[argn + 3]);
+      viewHeading = atof(argv[argn + 4]);
+      viewPitch = atof(argv[argn + 5]);
+      if ((viewPitch <= -80.0) || (viewPitch >= 80.0)) {
+        printf("ERROR: The pitch of a view must be between -80 and 80 degrees!\n");
+        return -1;
+      }
+      view = 1;
+      argn += 6;
+    }
+    else if (!strcmp(argv[argn], "-fov") && (argn + 1 < argc)) {
+      viewFov = atof(argv[argn + 1]);
+      if ((viewFov < 1.0) || (viewFov > 170.0)) {
+        printf("ERROR: The field of view must be from 1 to 170 degrees!\n");
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-size") && (argn + 2 < argc)) {
+      viewWidth = atoi(argv[argn + 1]);
+      viewHeight = atoi(argv[argn + 2]);
+      if ((viewWidth < 1) || (viewWidth > MAXVIEWSIZE) || (viewHeight < 1) || (viewHeight > MAXVIEWSIZE)) {
+        printf("ERROR: A view must be from 1 to %d pixels each way!\n", MAXVIEWSIZE);
+        return -1;
+      }
+      argn += 3;
+    }
+    else if (!strcmp(argv[argn], "-types")) {
+      types = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-iso") && (argn + 1 < argc)) {
+      iso = atoi(argv[argn + 1]);
+      if ((iso < 1) || (iso > MAXISOSCALE)) {
+        printf("ERROR: The scale of an isometric picture must be from 1 to %d!\n", MAXISOSCALE);
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-relief") && (argn + 1 < argc)) {
+      isoRelief = atof(argv[argn + 1]);
+      if ((isoRelief < 0.0) || (isoRelief > 100.0)) {
+        printf("ERROR: The relief must be from 0 to 100!\n");
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-maxzoom") && (argn + 1 < argc)) {
+      maxZoom = atoi(argv[argn + 1]);
+      if ((maxZoom < TILEZOOM) || (maxZoom > MAXTILEZOOM)) {
+        printf("ERROR: The deepest zoom level must be from %d to %d!\n", TILEZOOM, MAXTILEZOOM);
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-update")) {
+      update = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-scale") && (argn + 1 < argc)) {
+      scale = atoi(argv[argn + 1]);
+      if ((scale < 1) || (scale > MAXSCALE)) {
+        printf("ERROR: The scale must be from 1 to %d!\n", MAXSCALE);
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-portal") && (argn + 1 < argc)) {
+      portalName = argv[argn + 1];
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-vegetation") && (argn + 1 < argc)) {
+      vegName = argv[argn + 1];
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-objects") && (argn + 1 < argc)) {
+      objName = argv[argn + 1];
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-mips")) {
+      mips = 1;
+      argn++;
+    }
+    else if (!strcmp(argv[argn], "-verify")) {
+      verify = 1;
+      argn++;
+    }
+    else {
+      printf("ERROR: Unknown option %s!\n", argv[argn]);
+      PrintUsage();
+      return -1;
+    }
+  }
+
+  if (argc - argn != 2) {
+    printf("ERROR: Incorrect number of arguments!\n");
+    PrintUsage();
+    return -1;
+  }
+  if ((scale > 1) && (tiles || update || verify)) {
+    printf("ERROR: -scale cannot be used with -tiles, -update or -verify!\n");
+    return -1;
+  }
+  if (mips && (tiles || update || (scale > 1))) {
+    printf("ERROR: -mips cannot be used with -tiles, -update or -scale!\n");
+    return -1;
+  }
+  if ((vegName != NULL) && (tiles || update || (scale > 1))) {
+    printf("ERROR: -vegetation cannot be used with -tiles, -update or -scale!\n");
+    return -1;
+  }
+  if ((objName != NULL) && ((update && !tiles) || (scale > 1))) {
+    printf("ERROR: Objects cannot be drawn with -scale, or updated except as tiles!\n");
+    return -1;
+  }
+  if (fromCell && (tiles || update || (scale > 1) || (lights.shadowStrength > 0.0) ||
+      (lights.occlusionStrength > 0.0))) {
+    printf("ERROR: -cell cannot be used with -tiles, -update, -scale, shadows or occlusion!\n");
+    return -1;
+  }
+  if ((numVariants > 1) && (tiles || update || (scale > 1) || mips || verify || fromCell || (vegName != NULL))) {
+    printf("ERROR: -variant cannot be used with -tiles, -update, -scale, -mips, -verify, -cell or -vegetation!\n");
+    return -1;
+  }
+
+  // Each variant starts from the other settings
+  memcpy(&variants[0].lt, &lights, sizeof(lighting));
+  variants[0].fileName = argv[argn + 1];
+  for (i = 1; i < numVariants; i++) {
+    memcpy(&variants[i].lt, &lights, sizeof(lighting));
+    if (!ReadConfig(&variants[i].lt, variantConfig[i - 1]))
+      return -1;
+  }
+  for (i = 0; (numVariants > 1) && (i < numVariants * 33); i++) {
+    if (variants[i / 33].lt.texture[i % 33] != 0) {
+      printf("ERROR: Textures cannot be used with -variant!\n");
+      return -1;
+    }
+  }
+  if (normals && (region || fromCell)) {
+    printf("ERROR: -normals needs the whole map file, so cannot be used with a region or -cell!\n");
+    return -1;
+  }
+  if (lowMem && (tiles || update || (scale > 1) || fromCell || normals || (numVariants > 1) ||
+      (lights.shadowStrength > 0.0) || (lights.occlusionStrength > 0.0))) {
+    printf("ERROR: -lowmem cannot be used with -tiles, -update, -scale, -cell, -normals, -variant, shadows or occlusion!\n");
+    return -1;
+  }
+  if (view && (tiles || update || (scale > 1) || mips || verify || fromCell || region || lowMem ||
+      (numVariants > 1) || (vegName != NULL))) {
+    printf("ERROR: -view cannot be used with -tiles, -update, -scale, -mips, -verify, -cell, a region, -lowmem, -variant or -vegetation!\n");
+    return -1;
+  }
+  if (iso && (tiles || update || (scale > 1) || mips || verify || fromCell || region || lowMem || view ||
+      (numVariants > 1) || (vegName != NULL))) {
+    printf("ERROR: -iso cannot be used with -tiles, -update, -scale, -mips, -verify, -cell, a region, -lowmem, -view, -variant or -vegetation!\n");
+    return -1;
+  }
+  if (types && (tiles || update || (scale > 1) || mips || verify || lowMem || view || iso || (numVariants > 1) ||
+      (vegName != NULL) || (objName != NULL) || (portalName != NULL))) {
+    printf("ERROR: -types cannot be used with -tiles, -update, -scale, -mips, -verify, -lowmem, -view, -iso, -variant, -vegetation, -objects or -portal!\n");
+    return -1;
+  }
+  if (region && (tiles || update || mips || fromCell)) {
+    printf("ERROR: A region cannot be used with -tiles, -update, -mips or -cell!\n");
+    return -1;
+  }
+  for (i = 0; (i < 33) && (lights.texture[i] == 0); i++)
+    ;
+  if ((portalName != NULL) != (i < 33)) {
+    printf("ERROR: -portal and texture settings must be used together!\n");
+    return -1;
+  }
+  if ((portalName != NULL) && (verify || (update && !tiles))) {
+    printf("ERROR: Textured pictures cannot be verified, or updated except as tiles!\n");
+    return -1;
+  }
+
+  // Read map file, or start reading cell.dat while everything else is set up
+  if (fromCell) {
+    if (!StartCell(argv[argn]))
+      return -1;
+  }
+  else {
+    mapFile = fopen(argv[argn], "rb");
+    if (mapFile == NULL) {
+      printf("ERROR: File %s could not be opened!\n", argv[argn]);
+      return -1;
+    }
+    if (lowMem) {
+      if (!RingBegin(mapFile, regionY0))
+        return -1;
+      numThreads = 1;
+    }
+    else {
+      // Shadows and occlusion look past the region, in any of the pictures
+      for (i = 0; (i < numVariants) && (variants[i].lt.shadowStrength <= 0.0) &&
+          (variants[i].lt.occlusionStrength <= 0.0); i++)
+        ;
+      if (region && (i == numVariants))
+        ReadRegion(mapFile);
+      else
+        fread(land, sizeof(landData), LANDSIZE * LANDSIZE, mapFile);
+      fclose(mapFile);
+    }
+  }
+
+  // With the default lighting, use the path specialized for it.  The SIMD kernel
+  // only knows one light, so several go through the multi-directional kernel.
+  if ((shade == ShadeRow) && !memcmp(&lights, &defaultLighting, sizeof(lighting)))
+    shade = ShadeRowDefault;
+  if ((lights.numDirections > 0) && (shade != ShadeRowLUT))
+    shade = ShadeRowMulti;
+
+  // The reference and default paths take their normals from the cache.  The
+  // SIMD kernel does not, so the cache is no use to it alone.
+  if (normals && (shade == ShadeRowSIMD) && (scale == 1) && (numVariants == 1) && (portalName == NULL)) {
+    printf("ERROR: -simd works out its own normals, so -normals is only any use with it for -scale, -variant or textures!\n");
+    return -1;
+  }
+  if (normals) {
+    if (!LoadNormals(argv[argn]))
+      return -1;
+    if (shade == ShadeRow)
+      shade = ShadeRowCached;
+    else if (shade == ShadeRowDefault)
+      shade = ShadeRowDefaultCached;
+  }
+
+  // Textures replace the colors, so the textured path is used whatever else
+  // was asked for
+  InitGamma();
+  InitVegetation();
+  if ((objName != NULL) && !LoadObjects(objName))
+    return -1;
+  if (portalName != NULL) {
+    if (!LoadTextures(portalName, scale))
+      return -1;
+    shade = ShadeRowTextured;
+  }
+
+  StartThreads();
+  InitColorScale();
+  InitMulti();
+  InitPNG();
+  if (types)
+    return WriteTypes(argv[argn + 1], fromCell);
+  if ((shade == ShadeRowLUT) && !InitLUT())
+    return -1;
+  if (!ComputeShadows() || !ComputeOcclusion())
+    return -1;
+  if (numVariants > 1)
+    return WriteVariants();
+  if (view)
+    return WriteView(shade, argv[argn + 1]);
+  if (iso)
+    return WriteIso(shade, argv[argn + 1], iso);
+
+  if (update) {
+    numDirty = ReadDirty(argv[argn]);
+    if (numDirty < 0)
+      return -1;
+    printf("Dirty land blocks: %d\n", numDirty);
+    if (tiles)
+      return WriteTiles(shade, argv[argn + 1], maxZoom, 1);
+    if (IsPNG(argv[argn + 1])) {
+      printf("ERROR: Only RAW pictures and tiles can be updated!\n");
+      return -1;
+    }
+    return UpdateRaw(argv[argn + 1]);
+  }
+
+  if (tiles)
+    return WriteTiles(shade, argv[argn + 1], maxZoom, 0);
+  if (scale > 1)
+    return WriteScaled(argv[argn + 1], scale);
+
+  // Shade and write the picture a group of rows at a time.  A group has a few
+  // bands for each thread, so that all of them have something to do.  With
+  // -lowmem, a group is one row.
+  groupRows = lowMem ? 1 : 2 * numThreads * BANDROWS;
+  rows = (uchar *)malloc(groupRows * LANDSIZE * 3);
+  ref = verify ? (uchar *)malloc(groupRows * LANDSIZE * 3) : NULL;
+  vegRows = (vegName != NULL) ? (uchar *)malloc(groupRows * LANDSIZE) : NULL;
+  if ((rows == NULL) || (verify && (ref == NULL)) || ((vegName != NULL) && (vegRows == NULL))) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+
+  width = regionX1 - regionX0 + 1;
+  height = regionY1 - regionY0 + 1;
+  if (!ImageOpen(&image, argv[argn + 1], width, height, 3))
+    return -1;
+  if ((vegName != NULL) && !ImageOpen(&vegImage, vegName, width, height, 1))
+    return -1;
+  if (mips && !MipBegin(argv[argn + 1]))
+    return -1;
+
+  maxDiff = 0;
+  numDiff = 0;
+  for (y = regionY0; y <= regionY1; y += numRows) {
+    numRows = (regionY1 + 1 - y < groupRows) ? regionY1 + 1 - y : groupRows;
+    if (fromCell && !CellRows(y + numRows))
+      return -1;
+    if (lowMem) {
+      if (!ShadeRing(shade, rows, vegRows, y, numMarks > 0))
+        return -1;
+    }
+    else
+      ShadeRows(shade, rows, vegRows, y, y + numRows, numMarks > 0);
+    CropRows(rows, numRows, 3);
+    ImageWriteRows(&image, rows, numRows);
+    if (vegName != NULL) {
+      CropRows(vegRows, numRows, 1);
+      ImageWriteRows(&vegImage, vegRows, numRows);
+    }
+    if (mips)
+      MipRows(rows, numRows);
+
+    // Compare against the reference path
+    if (verify) {
+      if (lowMem)
+        ShadeRing(ShadeRow, ref, NULL, y, numMarks > 0);
+      else
+        ShadeRows(ShadeRow, ref, NULL, y, y + numRows, numMarks > 0);
+      CropRows(ref, numRows, 3);
+      for (i = 0; i < numRows * width * 3; i++) {
+        diff = abs(rows[i] - ref[i]);
+        if (diff > 0)
+          numDiff++;
+        if (diff > maxDiff)
+          maxDiff = diff;
+      }
+    }
+  }
+  ImageClose(&image);
+  if (vegName != NULL)
+    ImageClose(&vegImage);
+  if (mips)
+    MipEnd();
+  free(rows);
+  free(ref);
+  free(vegRows);
+  if (lowMem)
+    fclose(ringFile);
+
+  if (verify) {
+    tolerance = ((shade == ShadeRowSIMD) || (shade == ShadeRowMulti)) ? SIMDTOLERANCE : 0;
+    printf("%ld of %d channels differ from the reference, by at most %d.\n", numDiff,
+        width * height * 3, maxDiff);
+    if (maxDiff > tolerance) {
+      printf("ERROR: Tolerance of %d exceeded!\n", tolerance);
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,257 @@
+// hmapac.c
+//
+// David Simpson
+// http://www.ugcs.caltech.edu/~dsimpson
+//
+// HMapAC exports a map file generated by mapac as plain rasters for GIS and 3D
+// tools.  Three pictures are written for the map:
+//
+// <OUT>_height.pgm    The height of each point in game units, which is 2.0 * Z
+//                     (see mapac.c), as 16 bit gray.  Unused points are 0.
+// <OUT>_type.pgm      The land type of each point, 0 to 31, as 8 bit gray.
+//                     Roads are 32, as in graphac, and unused points are 255.
+// <OUT>_coverage.pgm  255 where the map has data and 0 where it does not.
+//
+// The pictures are binary PGMs, which most tools read (GDAL calls them PNM).
+// 16 bit PGMs store each value high byte first.  Each picture comes with a
+// world file, <picture>.wld, that places it in game units: a point is 24.0
+// units from the next, x runs east from the west edge of the map, and y runs
+// north from the south edge, so the picture's rows go down in y.  The
+// center of the top left pixel is given, as world files do.
+//
+// With -tile N, the map is cut into tiles of N points square instead, named
+// <OUT>_height_<TX>_<TY>.pgm and so on, with TX counting east and TY south
+// from the northwest corner.  The tiles on the east and south edges are
+// smaller.  Each tile has its own world file, so they line up.
+//
+// The map file is mapped into memory rather than read, and each picture is
+// written a row at a time straight from it, so only the parts being written
+// are ever loaded.
+//
+// hmapac my.map dereth
+// hmapac -tile 512 my.map tiles/dereth
+//
+// Under Linux, compile with
+//    gcc -O2 hmapac.c -o hmapac
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define uchar  unsigned char
+#define ushort unsigned short
+#define uint   unsigned int
+#define ulong  unsigned long
+
+#define LANDSIZE  2041
+#define POINTSIZE 24.0
+
+typedef struct {
+  ushort type;
+  uchar  z;
+  uchar  used;
+} landData;
+
+// The kinds of picture written
+#define HEIGHT   0
+#define TYPE     1
+#define COVERAGE 2
+
+const char *rasterName[3] = {"height", "type", "coverage"};
+
+landData *land;
+
+void PrintUsage()
+{
+  printf("usage: hmapac [-tile <N>] <MAP FILE> <OUT>\n");
+  printf("   Writes <OUT>_height.pgm, <OUT>_type.pgm and <OUT>_coverage.pgm, each\n");
+  printf("   with a world file.  -tile cuts them into tiles of N points square.\n");
+}
+
+// Maps the map file into memory.  Returns NULL if it cannot be.
+landData *MapLand(char *fileName)
+{
+#ifdef _WIN32
+  HANDLE        file, mapping;
+  LARGE_INTEGER size;
+  void          *view;
+
+  file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return NULL;
+  }
+  if (!GetFileSizeEx(file, &size) || (size.QuadPart != (LONGLONG)LANDSIZE * LANDSIZE * sizeof(landData))) {
+    printf("ERROR: File %s is not a map file!\n", fileName);
+    CloseHandle(file);
+    return NULL;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  view = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (mapping != NULL)
+    CloseHandle(mapping);
+  CloseHandle(file);
+  if (view == NULL) {
+    printf("ERROR: File %s could not be mapped!\n", fileName);
+    return NULL;
+  }
+  return (landData *)view;
+#else
+  struct stat info;
+  void        *view;
+  int         fd;
+
+  fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return NULL;
+  }
+  if ((fstat(fd, &info) != 0) || (info.st_size != (off_t)LANDSIZE * LANDSIZE * sizeof(landData))) {
+    printf("ERROR: File %s is not a map file!\n", fileName);
+    close(fd);
+    return NULL;
+  }
+  view = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) {
+    printf("ERROR: File %s could not be mapped!\n", fileName);
+    return NULL;
+  }
+  return (landData *)view;
+#endif
+}
+
+// Converts width points of a row of the map into a row of a picture
+void RasterRow(int raster, landData *row, int width, uchar *out)
+{
+  int x, value;
+
+  for (x = 0; x < width; x++) {
+    if (raster == HEIGHT) {
+      value = row[x].used ? 2 * row[x].z : 0;
+      out[x * 2] = (uchar)(value >> 8);
+      out[x * 2 + 1] = (uchar)value;
+    }
+    else if (raster == TYPE) {
+      if (!row[x].used)
+        out[x] = 255;
+      else if ((row[x].type & 0x0003) != 0)
+        out[x] = 32;
+      else
+        out[x] = (uchar)((row[x].type & 0x00FF) >> 2);
+    }
+    else
+      out[x] = row[x].used ? 255 : 0;
+  }
+}
+
+// Writes the picture of the points from (x0, y0) on, width by height, and its
+// world file
+int WriteRaster(int raster, char *name, int x0, int y0, int width, int height)
+{
+  FILE  *outFile;
+  char  fileName[1024];
+  uchar *row;
+  int   y, bytes;
+
+  sprintf(fileName, "%s.pgm", name);
+  outFile = fopen(fileName, "wb");
+  if (outFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+  bytes = (raster == HEIGHT) ? 2 : 1;
+  fprintf(outFile, "P5\n%d %d\n%d\n", width, height, (raster == HEIGHT) ? 65535 : 255);
+  row = (uchar *)malloc(width * bytes);
+  if (row == NULL) {
+    printf("ERROR: Out of memory!\n");
+    fclose(outFile);
+    return 0;
+  }
+  for (y = y0; y < y0 + height; y++) {
+    RasterRow(raster, &land[(long)y * LANDSIZE + x0], width, row);
+    fwrite(row, bytes, width, outFile);
+  }
+  free(row);
+  if (fclose(outFile) != 0) {
+    printf("ERROR: File %s could not be written!\n", fileName);
+    return 0;
+  }
+
+  sprintf(fileName, "%s.wld", name);
+  outFile = fopen(fileName, "w");
+  if (outFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+  fprintf(outFile, "%.1f\n0.0\n0.0\n%.1f\n%.1f\n%.1f\n", POINTSIZE, -POINTSIZE, x0 * POINTSIZE,
+      (LANDSIZE - 1 - y0) * POINTSIZE);
+  fclose(outFile);
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  char name[1024];
+  int  argn, tile, raster, tx, ty, numTiles;
+
+  tile = 0;
+  argn = 1;
+  while ((argn < argc) && (argv[argn][0] == '-')) {
+    if (!strcmp(argv[argn], "-tile") && (argn + 1 < argc)) {
+      tile = atoi(argv[argn + 1]);
+      if (tile < 1) {
+        printf("ERROR: Tiles must be at least 1 point across!\n");
+        return -1;
+      }
+      argn += 2;
+    }
+    else {
+      printf("ERROR: Unknown option %s!\n", argv[argn]);
+      PrintUsage();
+      return -1;
+    }
+  }
+  if (argc - argn != 2) {
+    printf("ERROR: Incorrect number of arguments!\n");
+    PrintUsage();
+    return -1;
+  }
+  if (strlen(argv[argn + 1]) > 900) {
+    printf("ERROR: Output name is too long!\n");
+    return -1;
+  }
+
+  land = MapLand(argv[argn]);
+  if (land == NULL)
+    return -1;
+
+  if (tile == 0)
+    tile = LANDSIZE;
+  numTiles = (LANDSIZE + tile - 1) / tile;
+  for (raster = HEIGHT; raster <= COVERAGE; raster++) {
+    for (ty = 0; ty < numTiles; ty++) {
+      for (tx = 0; tx < numTiles; tx++) {
+        if (numTiles == 1)
+          sprintf(name, "%s_%s", argv[argn + 1], rasterName[raster]);
+        else
+          sprintf(name, "%s_%s_%d_%d", argv[argn + 1], rasterName[raster], tx, ty);
+        if (!WriteRaster(raster, name, tx * tile, ty * tile, (tx * tile + tile > LANDSIZE) ? LANDSIZE - tx * tile : tile,
+            (ty * tile + tile > LANDSIZE) ? LANDSIZE - ty * tile : tile))
+          return -1;
+      }
+    }
+  }
+  printf("%d pictures written.\n", 3 * numTiles * numTiles);
+
+  return 0;
+}
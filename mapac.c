@@ -27,6 +27,26 @@
 // this way.
 //
 // If you want pretty graphics from this map data, see graphac.
+//
+// Every landblock whose data changed is also recorded in <MAP FILE>.dirty, so
+// that graphac -update can redo just those parts of a picture.  A change to a
+// point alters the normals of the points next to it, so the landblocks that
+// hold those neighbours are recorded as well.  The dirty file is 256 * 256
+// bytes, one per landblock, indexed [xx][yy], and is nonzero for dirty
+// landblocks.  Each run adds to the dirty landblocks already in the file.
+// Delete it once all your pictures are updated.  NEWMAP deletes it too.
+//
+// The objects and buildings placed on the land are stored in <MAP FILE>.obj,
+// for graphac -objects.  Each is an objectData record (see Object Blocks
+// below).  When cell.dat has the object block of a landblock, it replaces all
+// the objects of that landblock in the file, and if they changed, that
+// landblock and the ones around it are recorded as dirty.  NEWMAP deletes the
+// object file too.
+//
+// graphac -normals keeps the normals of the map in <MAP FILE>.nrm, which
+// starts with a 255 * 255 byte table, indexed [xx][yy], that is nonzero for
+// landblocks whose normals are good.  Each run clears it for the landblocks it
+// marks dirty, so graphac redoes them.  NEWMAP deletes the normal file.
 
 // CELL.DAT
 //
@@ -86,6 +106,32 @@
 // I don't know much about the vegetation bits other than that is what they
 // seem to be.  Go ahead, play with them.
 
+// Object Blocks
+//
+// The object block of a landblock, xxyyFFFE, is made up of many sectors.  See
+// exc.c for what I know of its format.  The buildings (the "other objects")
+// start out like the plain objects, with a model id and a position within the
+// landblock, but go on with a list of portals, which must be stepped over to
+// get to the next building.  As far as I can tell that part is as follows:
+//
+// uint   # of leaves
+// uint   # of portals
+// Portal portals[# of portals]
+//
+// Portals have the following data format:
+//
+// ushort Flags
+// ushort Other cell id
+// ushort Other portal id
+// ushort # of stabs
+// ushort Stabs[# of stabs]
+// ushort Pad (if # of stabs is odd)
+//
+// The count of buildings is only a ushort; the ushort after it holds flags.
+// If a block does not make sense, the objects read up to that point are kept
+// and a warning is printed.  The position of an object is in units from the
+// southwest corner of its landblock, 192 units to a landblock, with y north.
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -107,7 +153,18 @@ typedef struct {
   uchar  used;
 } landData;
 
-landData land[LANDSIZE][LANDSIZE];
+typedef struct {
+  uint  block;     // Landblock id of the object block (xxyyFFFE)
+  uint  id;        // Model id in PORTAL.DAT
+  float x, y, z;   // Position within the landblock
+  uint  building;  // 1 for a building, 0 for any other object
+} objectData;
+
+landData   land[LANDSIZE][LANDSIZE];
+uchar      dirty[256][256];
+objectData *objects;
+int        numObjects, maxObjects;
+uchar      objectsFound[256][256];
 
 void PrintUsage()
 {
@@ -117,6 +174,34 @@ void PrintUsage()
   printf("   WARNING: Argument NEWMAP creates a new map, erasing all previous data!\n");
 }
 
+// Marks every landblock that holds the point (x, y) as dirty.  Points on the
+// edge of a landblock are shared with the landblocks next to it.
+void markPointDirty(int x, int y)
+{
+  int blockX, blockY, row;
+
+  if ((x < 0) || (x >= LANDSIZE) || (y < 0) || (y >= LANDSIZE))
+    return;
+
+  row = LANDSIZE - 1 - y;
+  for (blockX = (x - 1) / 8; blockX <= x / 8; blockX++) {
+    for (blockY = (row - 1) / 8; blockY <= row / 8; blockY++) {
+      if ((blockX >= 0) && (blockX < 255) && (blockY >= 0) && (blockY < 255))
+        dirty[blockX][blockY] = 1;
+    }
+  }
+}
+
+// Marks the point (x, y) and its neighbours, whose normals depend on it, dirty
+void markDirty(int x, int y)
+{
+  markPointDirty(x, y);
+  markPointDirty(x - 1, y);
+  markPointDirty(x + 1, y);
+  markPointDirty(x, y - 1);
+  markPointDirty(x, y + 1);
+}
+
 void writeLandData(uchar *sec, uint blockX, uint blockY)
 {
   uint   startX, startY;
@@ -142,6 +227,9 @@ void writeLandData(uchar *sec, uint blockX, uint blockY)
       if (land[startY - y][startX + x].used && ((oldType != newType) || (oldZ != newZ)))
         printf("(%4d, %4d) was %04X, %3d.  Now %04X, %3d.\n", startX + x, startY - y, oldType, oldZ, newType, newZ);
 
+      if (!land[startY - y][startX + x].used || (oldType != newType) || (oldZ != newZ))
+        markDirty(startX + x, startY - y);
+
       // Write new data point
       land[startY - y][startX + x].type = newType;
       land[startY - y][startX + x].z = newZ;
@@ -150,12 +238,104 @@ void writeLandData(uchar *sec, uint blockX, uint blockY)
   }
 }
 
-int ReadDir(FILE *inFile, uint dirPos)
+int FetchFile(FILE *inFile, uint filePos, uint len, uchar *buf)
 {
-  uint dir[4 * CELLSECSIZE];
   uint sec[CELLSECSIZE];
-  uint numFiles;
-  uint i, found;
+
+  while (len > 0) {
+    if (filePos == 0) {
+      printf("ERROR: NULL file pointer found!\n");
+      return 0;
+    }
+    if ((fseek(inFile, filePos, SEEK_SET) != 0) || (fread(sec, sizeof(uint), CELLSECSIZE, inFile) != CELLSECSIZE)) {
+      printf("ERROR: Sector at %08X could not be read!\n", filePos);
+      return 0;
+    }
+    filePos = sec[0] & 0x7FFFFFFF;
+
+    if (len > (CELLSECSIZE - 1) * sizeof(uint)) {
+      memcpy(buf, &sec[1], (CELLSECSIZE - 1) * sizeof(uint));
+      buf += (CELLSECSIZE - 1) * sizeof(uint);
+      len -= (CELLSECSIZE - 1) * sizeof(uint);
+    }
+    else {
+      memcpy(buf, &sec[1], len);
+      len = 0;
+    }
+  }
+
+  return 1;
+}
+
+void addObject(uint block, uint *data, uint building)
+{
+  if (numObjects == maxObjects) {
+    maxObjects = (maxObjects > 0) ? maxObjects * 2 : 4096;
+    objects = (objectData *)realloc(objects, maxObjects * sizeof(objectData));
+    assert(objects != NULL);
+  }
+  objects[numObjects].block = block;
+  objects[numObjects].id = data[0];
+  memcpy(&objects[numObjects].x, &data[1], sizeof(float));
+  memcpy(&objects[numObjects].y, &data[2], sizeof(float));
+  memcpy(&objects[numObjects].z, &data[3], sizeof(float));
+  objects[numObjects].building = building;
+  numObjects++;
+}
+
+// Reads the objects and buildings out of an object block
+void readObjects(uchar *buf, uint len)
+{
+  uint   *data;
+  uint   block, pos, num, i, j, numPortals;
+  ushort numStabs;
+
+  if (len < 12)
+    return;
+  data = (uint *)buf;
+  block = data[0];
+  objectsFound[block >> 24][(block >> 16) & 0xFF] = 1;
+
+  num = data[2];
+  pos = 12;
+  for (i = 0; i < num; i++, pos += 32) {
+    if (pos + 32 > len) {
+      printf("WARNING: Object block %08X ends early!\n", block);
+      return;
+    }
+    addObject(block, (uint *)&buf[pos], 0);
+  }
+
+  if (pos + 4 > len)
+    return;
+  num = *(ushort *)&buf[pos];
+  pos += 4;
+  for (i = 0; i < num; i++) {
+    if (pos + 40 > len) {
+      printf("WARNING: Object block %08X ends early!\n", block);
+      return;
+    }
+    addObject(block, (uint *)&buf[pos], 1);
+    numPortals = *(uint *)&buf[pos + 36];
+    pos += 40;
+    for (j = 0; j < numPortals; j++) {
+      if (pos + 8 > len) {
+        printf("WARNING: Object block %08X ends early!\n", block);
+        return;
+      }
+      numStabs = *(ushort *)&buf[pos + 6];
+      pos += 8 + ((numStabs + 1) & ~1) * sizeof(ushort);
+    }
+  }
+}
+
+int ReadDir(FILE *inFile, uint dirPos)
+{
+  uint  dir[4 * CELLSECSIZE];
+  uint  sec[CELLSECSIZE];
+  uint  numFiles;
+  uint  i, found;
+  uchar *buf;
 
   // Read the directory
   assert(dirPos != 0);
@@ -196,6 +376,14 @@ int ReadDir(FILE *inFile, uint dirPos)
       writeLandData((uchar *)sec, sec[1] >> 24, (sec[1] & 0x00FF0000) >> 16);
       found++;
     }
+    else if ((dir[i * 3 + NUMFILELOC + 1] & 0x0000FFFF) == 0x0000FFFE) {
+      // File is an object block, so read the objects out of it
+      buf = (uchar *)malloc(dir[i * 3 + NUMFILELOC + 3] + 4);
+      assert(buf != NULL);
+      if (FetchFile(inFile, dir[i * 3 + NUMFILELOC + 2], dir[i * 3 + NUMFILELOC + 3], buf))
+        readObjects(buf, dir[i * 3 + NUMFILELOC + 3]);
+      free(buf);
+    }
   }
 
   // If subdirectories exist, recurse into them
@@ -207,10 +395,172 @@ int ReadDir(FILE *inFile, uint dirPos)
   return found;
 }
 
+// Hashes the objects of each landblock, in any order, so that the objects
+// before and after can be compared
+void hashObjects(objectData *obj, int num, uint hash[256][256])
+{
+  uchar *p;
+  uint  h;
+  int   i, j;
+
+  for (i = 0; i < num; i++) {
+    p = (uchar *)&obj[i];
+    h = 2166136261u;
+    for (j = 0; j < (int)sizeof(objectData); j++)
+      h = (h ^ p[j]) * 16777619u;
+    hash[obj[i].block >> 24][(obj[i].block >> 16) & 0xFF] += h;
+  }
+}
+
+// Replaces the objects of the landblocks found in cell.dat with the new ones,
+// keeping the rest of the object file, and marks the landblocks around any
+// whose objects changed as dirty
+int writeObjects(char *mapName)
+{
+  static uint oldHash[256][256], newHash[256][256];
+  FILE        *objFile;
+  char        *fileName;
+  objectData  *old;
+  long        size;
+  int         numOld, numKept, i, x, y, dx, dy;
+
+  fileName = (char *)malloc(strlen(mapName) + 5);
+  sprintf(fileName, "%s.obj", mapName);
+
+  old = NULL;
+  numOld = 0;
+  objFile = fopen(fileName, "rb");
+  if (objFile != NULL) {
+    fseek(objFile, 0, SEEK_END);
+    size = ftell(objFile);
+    fseek(objFile, 0, SEEK_SET);
+    numOld = (int)(size / sizeof(objectData));
+    old = (objectData *)malloc((numOld + 1) * sizeof(objectData));
+    assert(old != NULL);
+    numOld = (int)fread(old, sizeof(objectData), numOld, objFile);
+    fclose(objFile);
+  }
+
+  hashObjects(old, numOld, oldHash);
+  hashObjects(objects, numObjects, newHash);
+  for (x = 0; x < 256; x++) {
+    for (y = 0; y < 256; y++) {
+      if (!objectsFound[x][y] || (oldHash[x][y] == newHash[x][y]))
+        continue;
+      for (dx = -1; dx <= 1; dx++) {
+        for (dy = -1; dy <= 1; dy++) {
+          if ((x + dx >= 0) && (x + dx < 255) && (y + dy >= 0) && (y + dy < 255))
+            dirty[x + dx][y + dy] = 1;
+        }
+      }
+    }
+  }
+
+  objFile = fopen(fileName, "wb");
+  if (objFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    free(old);
+    free(fileName);
+    return -1;
+  }
+  numKept = 0;
+  for (i = 0; i < numOld; i++) {
+    if (!objectsFound[old[i].block >> 24][(old[i].block >> 16) & 0xFF]) {
+      fwrite(&old[i], sizeof(objectData), 1, objFile);
+      numKept++;
+    }
+  }
+  fwrite(objects, sizeof(objectData), numObjects, objFile);
+  fclose(objFile);
+  printf("Total objects: %d\n", numKept + numObjects);
+
+  free(old);
+  free(fileName);
+  return 0;
+}
+
+// Marks the normals of this run's dirty landblocks as no longer valid in the
+// normal file, if there is one
+void invalidateNormals(char *mapName)
+{
+  FILE  *nrmFile;
+  char  *fileName;
+  uchar valid[255][255];
+  int   x, y;
+
+  fileName = (char *)malloc(strlen(mapName) + 5);
+  sprintf(fileName, "%s.nrm", mapName);
+  nrmFile = fopen(fileName, "r+b");
+  free(fileName);
+  if (nrmFile == NULL)
+    return;
+
+  if (fread(valid, sizeof(valid), 1, nrmFile) == 1) {
+    for (x = 0; x < 255; x++) {
+      for (y = 0; y < 255; y++) {
+        if (dirty[x][y])
+          valid[x][y] = 0;
+      }
+    }
+    fseek(nrmFile, 0, SEEK_SET);
+    fwrite(valid, sizeof(valid), 1, nrmFile);
+  }
+  fclose(nrmFile);
+}
+
+// Adds the dirty landblocks to those already in the dirty file
+int writeDirty(char *mapName)
+{
+  FILE  *dirtyFile;
+  char  *fileName;
+  uchar old[256][256];
+  int   x, y, numDirty;
+
+  fileName = (char *)malloc(strlen(mapName) + 7);
+  sprintf(fileName, "%s.dirty", mapName);
+
+  dirtyFile = fopen(fileName, "rb");
+  if (dirtyFile != NULL) {
+    if (fread(old, sizeof(old), 1, dirtyFile) == 1) {
+      for (x = 0; x < 256; x++) {
+        for (y = 0; y < 256; y++)
+          dirty[x][y] |= old[x][y];
+      }
+    }
+    fclose(dirtyFile);
+  }
+
+  numDirty = 0;
+  for (x = 0; x < 256; x++) {
+    for (y = 0; y < 256; y++) {
+      if (dirty[x][y])
+        numDirty++;
+    }
+  }
+  if (numDirty == 0) {
+    free(fileName);
+    return 0;
+  }
+
+  dirtyFile = fopen(fileName, "wb");
+  if (dirtyFile == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    free(fileName);
+    return -1;
+  }
+  fwrite(dirty, sizeof(dirty), 1, dirtyFile);
+  fclose(dirtyFile);
+  printf("Dirty land blocks: %d\n", numDirty);
+  free(fileName);
+
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   FILE *mapFile;
   FILE *cellFile;
+  char *fileName;
   uint cellDirPtr;
   int  found;
   int  x, y;
@@ -239,6 +589,16 @@ int main(int argc, char *argv[])
     }
     fwrite(land, sizeof(landData), LANDSIZE * LANDSIZE, mapFile);
     fclose(mapFile);
+
+    // A dirty file left over from an old map means nothing now
+    fileName = (char *)malloc(strlen(argv[2]) + 7);
+    sprintf(fileName, "%s.dirty", argv[2]);
+    remove(fileName);
+    sprintf(fileName, "%s.obj", argv[2]);
+    remove(fileName);
+    sprintf(fileName, "%s.nrm", argv[2]);
+    remove(fileName);
+    free(fileName);
     return 0;
   }
 
@@ -264,6 +624,7 @@ int main(int argc, char *argv[])
   found = ReadDir(cellFile, cellDirPtr);
   fclose(cellFile);
   printf("Total land blocks found: %d\n", found);
+  printf("Objects found: %d\n", numObjects);
 
   // Count the number of each land type in the map data, and print it out.
   for (x = 0; x < 256; x++)
@@ -291,6 +652,10 @@ int main(int argc, char *argv[])
   fwrite(land, sizeof(landData), LANDSIZE * LANDSIZE, mapFile);
   fclose(mapFile);
 
-  return 0;
+  // Write out the objects before the dirty file, since they may dirty more
+  if (writeObjects(argv[2]) != 0)
+    return -1;
+  invalidateNormals(argv[2]);
+  return writeDirty(argv[2]);
 }
  
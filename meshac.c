@@ -0,0 +1,899 @@
+// meshac.c
+//
+// David Simpson
+// http://www.ugcs.caltech.edu/~dsimpson
+//
+// MeshAC turns a map file generated by mapac into a 3D mesh of the land, as a
+// Wavefront OBJ or a binary glTF (.glb) file, depending on how the output name
+// ends.  Each point becomes a vertex colored by its land type, with the same
+// colors graphac starts from before any lighting.  Positions are in game
+// units: x runs east from the west edge of the map, y is up (2.0 * Z, see
+// mapac.c), and z runs south, so north is -z as most 3D tools expect.  glTF
+// wants vertex colors in linear light, so a .glb gets them turned from sRGB
+// into 16 bits each; an OBJ keeps the sRGB colors.
+//
+// The mesh is built one land block (8 by 8 cells) at a time, and each block is
+// simplified on its own with a quadtree.  A node of the quadtree is drawn as a
+// fan of triangles around its center point, and is split into four when any
+// of its points is more than half the allowed error away from that fan, or
+// when any of its points is unused.  Single cells are never split and are
+// drawn as two triangles.  Unused cells are left out.
+//
+// Where a node is next to smaller nodes, their corners lie along its edges.
+// The fan takes in every such point, so neighbouring nodes share their edges
+// exactly and no cracks open up.  Across the edge of a land block, the
+// quadtree of the block next door is worked out too, for the same reason.
+// The extra points can move a fan by at most the error it was built with,
+// which is why nodes are held to half of -error: no point of the mesh ends up
+// more than -error game units away from the map.  -error 0 only merges cells
+// that lie exactly in a plane, so nothing is lost.
+//
+// -lods N writes N levels of detail in one pass, each allowed twice the error
+// of the one before, as <OUT>_lod0.obj, <OUT>_lod1.obj and so on.
+//
+// The map file is mapped into memory rather than read.  The blocks of each
+// row of land blocks are built on several threads, then written out in order
+// before the next row is started, so only one row of blocks is ever held.  An
+// OBJ file gets a group per land block, named for it as in mapac.  A glTF file
+// holds one mesh, with the vertices of each block together; the triangles go
+// to a temporary file and are copied in at the end, since glTF wants them
+// after all the vertices.
+//
+// meshac my.map dereth.obj
+// meshac -error 4 -lods 3 my.map dereth.glb
+//
+// Under Linux, compile with
+//    gcc -O2 meshac.c -o meshac -lm -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define uchar  unsigned char
+#define ushort unsigned short
+#define uint   unsigned int
+#define ulong  unsigned long
+
+#define LANDSIZE  2041
+#define POINTSIZE 24
+
+// Land blocks are BLOCKSIZE cells across, and there are NUMBLOCKS of them
+// along each side of the map
+#define BLOCKSIZE 8
+#define NUMBLOCKS ((LANDSIZE - 1) / BLOCKSIZE)
+
+#define MAXLODS 8
+
+// The same as COLORCORRECTION in graphac
+#define COLORCORRECTION 70.0
+
+typedef struct {
+  ushort type;
+  uchar  z;
+  uchar  used;
+} landData;
+
+// The base colors of the land types, from graphac.  The fourth number is the
+// brightness of the control patch each color was measured against.  The last
+// entry is the color for the roads.
+const uchar landColor[33][4] = {
+  {84, 67, 37, 110},
+  {56, 66, 21, 110},
+  {147, 154, 167, 110},
+  {51, 69, 10, 110},
+  {71, 37, 7, 113},
+  {54, 34, 23, 113},
+  {39, 35, 43, 113},
+  {89, 65, 34, 113},
+  {57, 41, 9, 113},
+  {44, 77, 2, 113},
+  {144, 99, 50, 113},
+  {132, 132, 97, 113},
+  {138, 93, 53, 114},
+  {111, 68, 41, 114},
+  {75, 85, 59, 114},
+  {208, 219, 233, 114},
+  {62, 108, 131, 130},
+  {20, 79, 56, 130},
+  {31, 80, 100, 130},
+  {44, 76, 94, 130},
+  {43, 59, 83, 130},
+  {34, 47, 6, 130},
+  {62, 108, 131, 130},
+  {30, 38, 26, 130},
+  {100, 79, 43, 130},
+  {45, 33, 33, 130},
+  {72, 72, 70, 130},
+  {197, 227, 242, 130},
+  {100, 79, 43, 130},
+  {100, 79, 43, 130},
+  {100, 79, 43, 130},
+  {100, 79, 43, 130},
+  {138, 130, 112, 130}
+};
+
+// The vertex color of each land type, in sRGB for an OBJ, and in linear light
+// for a .glb (with an alpha of 1)
+uchar  vertexColor[33][3];
+ushort vertexLinear[33][4];
+
+landData *land;
+
+void PrintUsage()
+{
+  printf("usage: meshac [options] <MAP FILE> <OUT>\n");
+  printf("   <OUT> ends in .obj for a Wavefront OBJ or .glb for a binary glTF.\n");
+  printf("   -error <E>     Let the mesh be up to E game units off the map (default: 0)\n");
+  printf("   -lods <N>      Write N levels of detail, doubling the error each time\n");
+  printf("   -threads <N>   Build on N threads (default: one per processor)\n");
+}
+
+// Maps the map file into memory.  Returns NULL if it cannot be.
+landData *MapLand(char *fileName)
+{
+#ifdef _WIN32
+  HANDLE        file, mapping;
+  LARGE_INTEGER size;
+  void          *view;
+
+  file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return NULL;
+  }
+  if (!GetFileSizeEx(file, &size) || (size.QuadPart != (LONGLONG)LANDSIZE * LANDSIZE * sizeof(landData))) {
+    printf("ERROR: File %s is not a map file!\n", fileName);
+    CloseHandle(file);
+    return NULL;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  view = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (mapping != NULL)
+    CloseHandle(mapping);
+  CloseHandle(file);
+  if (view == NULL) {
+    printf("ERROR: File %s could not be mapped!\n", fileName);
+    return NULL;
+  }
+  return (landData *)view;
+#else
+  struct stat info;
+  void        *view;
+  int         fd;
+
+  fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return NULL;
+  }
+  if ((fstat(fd, &info) != 0) || (info.st_size != (off_t)LANDSIZE * LANDSIZE * sizeof(landData))) {
+    printf("ERROR: File %s is not a map file!\n", fileName);
+    close(fd);
+    return NULL;
+  }
+  view = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (view == MAP_FAILED) {
+    printf("ERROR: File %s could not be mapped!\n", fileName);
+    return NULL;
+  }
+  return (landData *)view;
+#endif
+}
+
+// Threads
+//
+// A small pool of worker threads is started once.  RunJob() hands the same job
+// function to every worker (and the calling thread) and returns when they have
+// all finished.  Jobs split their own work up by taking block numbers from a
+// shared counter with AtomicAdd().  This is the same pool as in graphac.
+
+typedef void (*jobFunc)(void *ctx);
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION   mutex;
+typedef CONDITION_VARIABLE condition;
+#define MutexInit(m)     InitializeCriticalSection(m)
+#define MutexLock(m)     EnterCriticalSection(m)
+#define MutexUnlock(m)   LeaveCriticalSection(m)
+#define CondInit(c)      InitializeConditionVariable(c)
+#define CondWait(c, m)   SleepConditionVariableCS(c, m, INFINITE)
+#define CondBroadcast(c) WakeAllConditionVariable(c)
+#define AtomicAdd(p, n)  InterlockedExchangeAdd((volatile LONG *)(p), (n))
+#else
+typedef pthread_mutex_t    mutex;
+typedef pthread_cond_t     condition;
+#define MutexInit(m)     pthread_mutex_init(m, NULL)
+#define MutexLock(m)     pthread_mutex_lock(m)
+#define MutexUnlock(m)   pthread_mutex_unlock(m)
+#define CondInit(c)      pthread_cond_init(c, NULL)
+#define CondWait(c, m)   pthread_cond_wait(c, m)
+#define CondBroadcast(c) pthread_cond_broadcast(c)
+#define AtomicAdd(p, n)  __sync_fetch_and_add((p), (n))
+#endif
+
+int       numThreads;
+mutex     poolLock;
+condition poolStart, poolDone;
+jobFunc   poolJob;
+void      *poolCtx;
+int       poolGeneration, poolBusy;
+
+int NumProcessors()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int)n : 1;
+#endif
+}
+
+#ifdef _WIN32
+DWORD WINAPI PoolWorker(LPVOID arg)
+#else
+void *PoolWorker(void *arg)
+#endif
+{
+  int     seen;
+  jobFunc job;
+  void    *ctx;
+
+  (void)arg;
+  seen = 0;
+  while (1) {
+    MutexLock(&poolLock);
+    while (poolGeneration == seen)
+      CondWait(&poolStart, &poolLock);
+    seen = poolGeneration;
+    job = poolJob;
+    ctx = poolCtx;
+    MutexUnlock(&poolLock);
+
+    job(ctx);
+
+    MutexLock(&poolLock);
+    poolBusy--;
+    if (poolBusy == 0)
+      CondBroadcast(&poolDone);
+    MutexUnlock(&poolLock);
+  }
+
+  return 0;
+}
+
+void StartThreads()
+{
+  int i;
+#ifdef _WIN32
+  HANDLE    handle;
+#else
+  pthread_t handle;
+#endif
+
+  MutexInit(&poolLock);
+  CondInit(&poolStart);
+  CondInit(&poolDone);
+  poolGeneration = 0;
+  poolBusy = 0;
+
+  // The calling thread does its share of every job, so it is not started here
+  for (i = 1; i < numThreads; i++) {
+#ifdef _WIN32
+    handle = CreateThread(NULL, 0, PoolWorker, NULL, 0, NULL);
+    if (handle == NULL) {
+      printf("WARNING: Only %d threads could be started.\n", i);
+      numThreads = i;
+      return;
+    }
+    CloseHandle(handle);
+#else
+    if (pthread_create(&handle, NULL, PoolWorker, NULL) != 0) {
+      printf("WARNING: Only %d threads could be started.\n", i);
+      numThreads = i;
+      return;
+    }
+    pthread_detach(handle);
+#endif
+  }
+}
+
+void RunJob(jobFunc job, void *ctx)
+{
+  if (numThreads <= 1) {
+    job(ctx);
+    return;
+  }
+
+  MutexLock(&poolLock);
+  poolJob = job;
+  poolCtx = ctx;
+  poolBusy = numThreads - 1;
+  poolGeneration++;
+  CondBroadcast(&poolStart);
+  MutexUnlock(&poolLock);
+
+  job(ctx);
+
+  MutexLock(&poolLock);
+  while (poolBusy > 0)
+    CondWait(&poolDone, &poolLock);
+  MutexUnlock(&poolLock);
+}
+
+// Simplifying a land block
+//
+// The points of a block are numbered 0 to BLOCKSIZE across and down from its
+// northwest corner.  A block's quadtree is worked out as the set of its points
+// that are the corner of some node, plus the list of nodes that were not
+// split (the leaves).
+
+#define BLOCKPOINTS (BLOCKSIZE + 1)
+#define MAXLEAVES   (BLOCKSIZE * BLOCKSIZE)
+
+// A single cell is two triangles, and a fan never has more triangles than
+// the cells under it have
+#define MAXBLOCKTRIANGLES (2 * BLOCKSIZE * BLOCKSIZE)
+
+typedef struct {
+  uchar x, y, size;
+} leaf;
+
+typedef struct {
+  uchar active[BLOCKPOINTS][BLOCKPOINTS];
+  leaf  leaves[MAXLEAVES];
+  int   numLeaves;
+} quadtree;
+
+// The mesh of one block.  Vertices are points of the block.
+typedef struct {
+  int   numVertices, numTriangles;
+  uchar vertex[BLOCKPOINTS * BLOCKPOINTS][2];
+  uchar triangle[MAXBLOCKTRIANGLES][3];
+} blockMesh;
+
+static landData *BlockPoint(int blockX, int blockY, int x, int y)
+{
+  return &land[(long)(blockY * BLOCKSIZE + y) * LANDSIZE + blockX * BLOCKSIZE + x];
+}
+
+// The height of the plane through three points at (x, y)
+static double Interpolate(int x0, int y0, double z0, int x1, int y1, double z1, int x2, int y2, double z2,
+    int x, int y)
+{
+  double area, w1, w2;
+
+  area = (double)((x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0));
+  w1 = ((x - x0) * (y2 - y0) - (x2 - x0) * (y - y0)) / area;
+  w2 = ((x1 - x0) * (y - y0) - (x - x0) * (y1 - y0)) / area;
+  return z0 + w1 * (z1 - z0) + w2 * (z2 - z0);
+}
+
+// Returns 1 if the node at (x0, y0) in the block has to be split: if any of its
+// points is unused, or more than tolerance away from the four triangles
+// fanned around its center
+static int SplitNode(int blockX, int blockY, int x0, int y0, int size, double tolerance)
+{
+  landData *p;
+  double   corner[4], center, z;
+  int      x, y, cx, cy, dx, dy, half;
+
+  for (y = y0; y <= y0 + size; y++) {
+    p = BlockPoint(blockX, blockY, x0, y);
+    for (x = 0; x <= size; x++) {
+      if (!p[x].used)
+        return 1;
+    }
+  }
+
+  half = size / 2;
+  cx = x0 + half;
+  cy = y0 + half;
+  center = 2.0 * BlockPoint(blockX, blockY, cx, cy)->z;
+  corner[0] = 2.0 * BlockPoint(blockX, blockY, x0, y0)->z;
+  corner[1] = 2.0 * BlockPoint(blockX, blockY, x0 + size, y0)->z;
+  corner[2] = 2.0 * BlockPoint(blockX, blockY, x0 + size, y0 + size)->z;
+  corner[3] = 2.0 * BlockPoint(blockX, blockY, x0, y0 + size)->z;
+
+  for (y = y0; y <= y0 + size; y++) {
+    p = BlockPoint(blockX, blockY, 0, y);
+    for (x = x0; x <= x0 + size; x++) {
+      dx = x - cx;
+      dy = y - cy;
+      if (dy <= -abs(dx))
+        z = Interpolate(cx, cy, center, x0, y0, corner[0], x0 + size, y0, corner[1], x, y);
+      else if (dx >= abs(dy))
+        z = Interpolate(cx, cy, center, x0 + size, y0, corner[1], x0 + size, y0 + size, corner[2], x, y);
+      else if (dy >= abs(dx))
+        z = Interpolate(cx, cy, center, x0 + size, y0 + size, corner[2], x0, y0 + size, corner[3], x, y);
+      else
+        z = Interpolate(cx, cy, center, x0, y0 + size, corner[3], x0, y0, corner[0], x, y);
+      if (fabs(2.0 * p[x].z - z) > tolerance)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void BuildNode(int blockX, int blockY, int x0, int y0, int size, double tolerance, quadtree *tree)
+{
+  int half;
+
+  tree->active[y0][x0] = 1;
+  tree->active[y0][x0 + size] = 1;
+  tree->active[y0 + size][x0] = 1;
+  tree->active[y0 + size][x0 + size] = 1;
+
+  if ((size > 1) && SplitNode(blockX, blockY, x0, y0, size, tolerance)) {
+    half = size / 2;
+    BuildNode(blockX, blockY, x0, y0, half, tolerance, tree);
+    BuildNode(blockX, blockY, x0 + half, y0, half, tolerance, tree);
+    BuildNode(blockX, blockY, x0, y0 + half, half, tolerance, tree);
+    BuildNode(blockX, blockY, x0 + half, y0 + half, half, tolerance, tree);
+  }
+  else {
+    tree->leaves[tree->numLeaves].x = x0;
+    tree->leaves[tree->numLeaves].y = y0;
+    tree->leaves[tree->numLeaves].size = size;
+    tree->numLeaves++;
+  }
+}
+
+// Works out the quadtree of a block.  It only depends on the points of the
+// block itself, so the blocks on either side of an edge agree on it.
+static void BuildTree(int blockX, int blockY, double tolerance, quadtree *tree)
+{
+  memset(tree->active, 0, sizeof(tree->active));
+  tree->numLeaves = 0;
+  BuildNode(blockX, blockY, 0, 0, BLOCKSIZE, tolerance, tree);
+}
+
+static int MeshVertex(blockMesh *mesh, int index[BLOCKPOINTS][BLOCKPOINTS], int x, int y)
+{
+  if (index[y][x] < 0) {
+    index[y][x] = mesh->numVertices;
+    mesh->vertex[mesh->numVertices][0] = x;
+    mesh->vertex[mesh->numVertices][1] = y;
+    mesh->numVertices++;
+  }
+  return index[y][x];
+}
+
+static void MeshTriangle(blockMesh *mesh, int index[BLOCKPOINTS][BLOCKPOINTS], int x0, int y0, int x1, int y1,
+    int x2, int y2)
+{
+  uchar *t;
+
+  t = mesh->triangle[mesh->numTriangles++];
+  t[0] = MeshVertex(mesh, index, x0, y0);
+  t[1] = MeshVertex(mesh, index, x1, y1);
+  t[2] = MeshVertex(mesh, index, x2, y2);
+}
+
+// Builds the mesh of a block.  Triangles wind counterclockwise seen from above.
+void BuildBlock(int blockX, int blockY, double tolerance, blockMesh *mesh)
+{
+  quadtree tree, next;
+  int      index[BLOCKPOINTS][BLOCKPOINTS];
+  int      edge[4 * BLOCKSIZE][2];
+  int      i, j, n, x0, y0, x1, y1, size;
+  leaf     *l;
+
+  BuildTree(blockX, blockY, tolerance, &tree);
+
+  // Take in the corners the blocks next door have along the shared edges
+  if (blockX > 0) {
+    BuildTree(blockX - 1, blockY, tolerance, &next);
+    for (i = 0; i < BLOCKPOINTS; i++)
+      tree.active[i][0] |= next.active[i][BLOCKSIZE];
+  }
+  if (blockX < NUMBLOCKS - 1) {
+    BuildTree(blockX + 1, blockY, tolerance, &next);
+    for (i = 0; i < BLOCKPOINTS; i++)
+      tree.active[i][BLOCKSIZE] |= next.active[i][0];
+  }
+  if (blockY > 0) {
+    BuildTree(blockX, blockY - 1, tolerance, &next);
+    for (i = 0; i < BLOCKPOINTS; i++)
+      tree.active[0][i] |= next.active[BLOCKSIZE][i];
+  }
+  if (blockY < NUMBLOCKS - 1) {
+    BuildTree(blockX, blockY + 1, tolerance, &next);
+    for (i = 0; i < BLOCKPOINTS; i++)
+      tree.active[BLOCKSIZE][i] |= next.active[0][i];
+  }
+
+  memset(index, 0xFF, sizeof(index));
+  mesh->numVertices = 0;
+  mesh->numTriangles = 0;
+  for (i = 0; i < tree.numLeaves; i++) {
+    l = &tree.leaves[i];
+    x0 = l->x;
+    y0 = l->y;
+    size = l->size;
+    x1 = x0 + size;
+    y1 = y0 + size;
+
+    if (size == 1) {
+      if (!BlockPoint(blockX, blockY, x0, y0)->used || !BlockPoint(blockX, blockY, x1, y0)->used ||
+          !BlockPoint(blockX, blockY, x0, y1)->used || !BlockPoint(blockX, blockY, x1, y1)->used)
+        continue;
+      MeshTriangle(mesh, index, x0, y0, x0, y1, x1, y1);
+      MeshTriangle(mesh, index, x0, y0, x1, y1, x1, y0);
+      continue;
+    }
+
+    // Walk the edge of the node counterclockwise from its northwest corner,
+    // collecting the corners of it and of any smaller nodes next to it
+    n = 0;
+    for (j = 0; j < size; j++) {
+      if (tree.active[y0 + j][x0]) {
+        edge[n][0] = x0;
+        edge[n++][1] = y0 + j;
+      }
+    }
+    for (j = 0; j < size; j++) {
+      if (tree.active[y1][x0 + j]) {
+        edge[n][0] = x0 + j;
+        edge[n++][1] = y1;
+      }
+    }
+    for (j = 0; j < size; j++) {
+      if (tree.active[y1 - j][x1]) {
+        edge[n][0] = x1;
+        edge[n++][1] = y1 - j;
+      }
+    }
+    for (j = 0; j < size; j++) {
+      if (tree.active[y0][x1 - j]) {
+        edge[n][0] = x1 - j;
+        edge[n++][1] = y0;
+      }
+    }
+    for (j = 0; j < n; j++)
+      MeshTriangle(mesh, index, x0 + size / 2, y0 + size / 2, edge[j][0], edge[j][1], edge[(j + 1) % n][0],
+          edge[(j + 1) % n][1]);
+  }
+}
+
+// Writing meshes
+//
+// Each level of detail has its own writer, and the blocks are handed to them
+// in order as they are built.
+
+#define OBJ 0
+#define GLB 1
+
+// Room left at the start of a .glb file for its JSON, which can only be
+// written once the sizes are known
+#define GLBJSONSIZE 2048
+#define GLBHEADERSIZE (12 + 8 + GLBJSONSIZE + 8)
+
+// A .glb vertex is its position in three floats, then its color in four
+// ushorts
+#define GLBVERTEXSIZE 20
+
+typedef struct {
+  int   format;
+  char  fileName[1024];
+  FILE  *file;
+  FILE  *indexFile;
+  uint  numVertices, numTriangles;
+  float min[3], max[3];
+} meshWriter;
+
+int OpenWriter(meshWriter *w, char *fileName, int format)
+{
+  uchar zero[GLBHEADERSIZE];
+
+  w->format = format;
+  strcpy(w->fileName, fileName);
+  w->numVertices = 0;
+  w->numTriangles = 0;
+  w->min[0] = w->min[1] = w->min[2] = FLT_MAX;
+  w->max[0] = w->max[1] = w->max[2] = -FLT_MAX;
+  w->indexFile = NULL;
+  w->file = fopen(fileName, (format == OBJ) ? "w" : "wb");
+  if (w->file == NULL) {
+    printf("ERROR: File %s could not be opened!\n", fileName);
+    return 0;
+  }
+
+  if (format == OBJ)
+    fprintf(w->file, "# Made by meshac from a map of Dereth.  1 unit is 1 game unit.\n");
+  else {
+    memset(zero, 0, sizeof(zero));
+    fwrite(zero, 1, GLBHEADERSIZE, w->file);
+    w->indexFile = tmpfile();
+    if (w->indexFile == NULL) {
+      printf("ERROR: A temporary file for %s could not be opened!\n", fileName);
+      fclose(w->file);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void WriteBlock(meshWriter *w, int blockX, int blockY, blockMesh *mesh)
+{
+  landData *p;
+  float    v[3];
+  uint     index[3];
+  int      i, j, x, y, type;
+
+  if (mesh->numTriangles == 0)
+    return;
+
+  if (w->format == OBJ)
+    fprintf(w->file, "g %02X%02X\n", blockX, NUMBLOCKS - 1 - blockY);
+
+  for (i = 0; i < mesh->numVertices; i++) {
+    x = blockX * BLOCKSIZE + mesh->vertex[i][0];
+    y = blockY * BLOCKSIZE + mesh->vertex[i][1];
+    p = BlockPoint(blockX, blockY, mesh->vertex[i][0], mesh->vertex[i][1]);
+    type = ((p->type & 0x0003) != 0) ? 32 : (p->type & 0x00FF) >> 2;
+    if (w->format == OBJ) {
+      fprintf(w->file, "v %d %d %d %.3f %.3f %.3f\n", x * POINTSIZE, 2 * p->z, (y - (LANDSIZE - 1)) * POINTSIZE,
+          vertexColor[type][0] / 255.0, vertexColor[type][1] / 255.0, vertexColor[type][2] / 255.0);
+    }
+    else {
+      v[0] = (float)(x * POINTSIZE);
+      v[1] = (float)(2 * p->z);
+      v[2] = (float)((y - (LANDSIZE - 1)) * POINTSIZE);
+      for (j = 0; j < 3; j++) {
+        if (v[j] < w->min[j])
+          w->min[j] = v[j];
+        if (v[j] > w->max[j])
+          w->max[j] = v[j];
+      }
+      fwrite(v, sizeof(float), 3, w->file);
+      fwrite(vertexLinear[type], sizeof(ushort), 4, w->file);
+    }
+  }
+
+  for (i = 0; i < mesh->numTriangles; i++) {
+    for (j = 0; j < 3; j++)
+      index[j] = w->numVertices + mesh->triangle[i][j];
+    if (w->format == OBJ)
+      fprintf(w->file, "f %u %u %u\n", index[0] + 1, index[1] + 1, index[2] + 1);
+    else
+      fwrite(index, sizeof(uint), 3, w->indexFile);
+  }
+
+  w->numVertices += mesh->numVertices;
+  w->numTriangles += mesh->numTriangles;
+}
+
+// Finishes the file.  For a .glb, the triangles are copied in after the
+// vertices and the JSON is written into the room left for it.  A .glb without
+// a single triangle is written again as a scene with nothing in it, since glTF
+// allows neither empty accessors nor empty buffers.
+int CloseWriter(meshWriter *w)
+{
+  char json[GLBJSONSIZE + 1];
+  uint header[5], vertexBytes, indexBytes;
+  char buf[65536];
+  int  len, read;
+
+  if ((w->format == GLB) && (w->numTriangles == 0)) {
+    fclose(w->indexFile);
+    fclose(w->file);
+    w->file = fopen(w->fileName, "wb");
+    if (w->file == NULL) {
+      printf("ERROR: File %s could not be opened!\n", w->fileName);
+      return 0;
+    }
+    len = sprintf(json, "{\"asset\":{\"version\":\"2.0\",\"generator\":\"meshac\"},\"scene\":0,"
+        "\"scenes\":[{}]}");
+    memset(json + len, ' ', GLBJSONSIZE - len);
+    header[0] = 0x46546C67;
+    header[1] = 2;
+    header[2] = 12 + 8 + GLBJSONSIZE;
+    header[3] = GLBJSONSIZE;
+    header[4] = 0x4E4F534A;
+    fwrite(header, sizeof(uint), 5, w->file);
+    fwrite(json, 1, GLBJSONSIZE, w->file);
+  }
+  else if (w->format == GLB) {
+    vertexBytes = w->numVertices * GLBVERTEXSIZE;
+    indexBytes = w->numTriangles * 12;
+    rewind(w->indexFile);
+    while ((read = fread(buf, 1, sizeof(buf), w->indexFile)) > 0)
+      fwrite(buf, 1, read, w->file);
+    fclose(w->indexFile);
+
+    len = sprintf(json, "{\"asset\":{\"version\":\"2.0\",\"generator\":\"meshac\"},\"scene\":0,"
+        "\"scenes\":[{\"nodes\":[0]}],\"nodes\":[{\"mesh\":0}],"
+        "\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"COLOR_0\":1},\"indices\":2}]}],"
+        "\"buffers\":[{\"byteLength\":%u}],"
+        "\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%u,\"byteStride\":%d,\"target\":34962},"
+        "{\"buffer\":0,\"byteOffset\":%u,\"byteLength\":%u,\"target\":34963}],"
+        "\"accessors\":[{\"bufferView\":0,\"byteOffset\":0,\"componentType\":5126,\"count\":%u,\"type\":\"VEC3\","
+        "\"min\":[%.1f,%.1f,%.1f],\"max\":[%.1f,%.1f,%.1f]},"
+        "{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5123,\"normalized\":true,\"count\":%u,\"type\":\"VEC4\"},"
+        "{\"bufferView\":1,\"byteOffset\":0,\"componentType\":5125,\"count\":%u,\"type\":\"SCALAR\"}]}",
+        vertexBytes + indexBytes, vertexBytes, GLBVERTEXSIZE, vertexBytes, indexBytes, w->numVertices,
+        w->min[0], w->min[1], w->min[2], w->max[0], w->max[1], w->max[2], w->numVertices, w->numTriangles * 3);
+    memset(json + len, ' ', GLBJSONSIZE - len);
+
+    header[0] = 0x46546C67;
+    header[1] = 2;
+    header[2] = GLBHEADERSIZE + vertexBytes + indexBytes;
+    header[3] = GLBJSONSIZE;
+    header[4] = 0x4E4F534A;
+    fseek(w->file, 0, SEEK_SET);
+    fwrite(header, sizeof(uint), 5, w->file);
+    fwrite(json, 1, GLBJSONSIZE, w->file);
+    header[0] = vertexBytes + indexBytes;
+    header[1] = 0x004E4942;
+    fwrite(header, sizeof(uint), 2, w->file);
+  }
+
+  if (fclose(w->file) != 0) {
+    printf("ERROR: File %s could not be written!\n", w->fileName);
+    return 0;
+  }
+  return 1;
+}
+
+// Building
+//
+// Each row of land blocks is built on all the threads, then written out.
+
+typedef struct {
+  int       blockY;
+  int       numLods;
+  double    tolerance[MAXLODS];
+  blockMesh *meshes;   // NUMBLOCKS * numLods of them
+  int       next;
+} rowJob;
+
+void BuildRow(void *ctx)
+{
+  rowJob *job = (rowJob *)ctx;
+  int    blockX, lod;
+
+  while ((blockX = AtomicAdd(&job->next, 1)) < NUMBLOCKS) {
+    for (lod = 0; lod < job->numLods; lod++)
+      BuildBlock(blockX, job->blockY, job->tolerance[lod], &job->meshes[blockX * job->numLods + lod]);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  meshWriter writer[MAXLODS];
+  rowJob     job;
+  char       fileName[1024], *ext;
+  double     error, color;
+  int        argn, numLods, format, lod, blockX, blockY, i, j, len;
+
+  numThreads = NumProcessors();
+  error = 0.0;
+  numLods = 1;
+  argn = 1;
+  while ((argn < argc) && (argv[argn][0] == '-')) {
+    if (!strcmp(argv[argn], "-threads") && (argn + 1 < argc)) {
+      numThreads = atoi(argv[argn + 1]);
+      if (numThreads < 1)
+        numThreads = 1;
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-error") && (argn + 1 < argc)) {
+      error = atof(argv[argn + 1]);
+      if (error < 0.0) {
+        printf("ERROR: The error cannot be negative!\n");
+        return -1;
+      }
+      argn += 2;
+    }
+    else if (!strcmp(argv[argn], "-lods") && (argn + 1 < argc)) {
+      numLods = atoi(argv[argn + 1]);
+      if ((numLods < 1) || (numLods > MAXLODS)) {
+        printf("ERROR: There can be 1 to %d levels of detail!\n", MAXLODS);
+        return -1;
+      }
+      argn += 2;
+    }
+    else {
+      printf("ERROR: Unknown option %s!\n", argv[argn]);
+      PrintUsage();
+      return -1;
+    }
+  }
+  if (argc - argn != 2) {
+    printf("ERROR: Incorrect number of arguments!\n");
+    PrintUsage();
+    return -1;
+  }
+  if ((numLods > 1) && (error == 0.0)) {
+    printf("ERROR: Levels of detail need an -error to double!\n");
+    return -1;
+  }
+
+  len = strlen(argv[argn + 1]);
+  ext = (len > 4) ? &argv[argn + 1][len - 4] : NULL;
+  if ((ext != NULL) && (!strcmp(ext, ".obj") || !strcmp(ext, ".OBJ")))
+    format = OBJ;
+  else if ((ext != NULL) && (!strcmp(ext, ".glb") || !strcmp(ext, ".GLB")))
+    format = GLB;
+  else {
+    printf("ERROR: Output file %s does not end in .obj or .glb!\n", argv[argn + 1]);
+    return -1;
+  }
+  if (len > 1000) {
+    printf("ERROR: Output name is too long!\n");
+    return -1;
+  }
+
+  land = MapLand(argv[argn]);
+  if (land == NULL)
+    return -1;
+
+  // A vertex gets the color graphac would give a point of its type under a
+  // lighting scalar of 256, and for a .glb that color in linear light
+  for (i = 0; i < 33; i++) {
+    for (j = 0; j < 3; j++) {
+      color = landColor[i][j] * COLORCORRECTION / landColor[i][3];
+      vertexColor[i][j] = (color > 255.0) ? 255 : (uchar)color;
+      color = vertexColor[i][j] / 255.0;
+      color = (color <= 0.04045) ? color / 12.92 : pow((color + 0.055) / 1.055, 2.4);
+      vertexLinear[i][j] = (ushort)(color * 65535.0 + 0.5);
+    }
+    vertexLinear[i][3] = 65535;
+  }
+
+  for (lod = 0; lod < numLods; lod++) {
+    if (numLods == 1)
+      strcpy(fileName, argv[argn + 1]);
+    else
+      sprintf(fileName, "%.*s_lod%d%s", len - 4, argv[argn + 1], lod, ext);
+    if (!OpenWriter(&writer[lod], fileName, format))
+      return -1;
+    job.tolerance[lod] = error * (1 << lod) / 2.0;
+  }
+
+  StartThreads();
+  job.numLods = numLods;
+  job.meshes = (blockMesh *)malloc(NUMBLOCKS * numLods * sizeof(blockMesh));
+  if (job.meshes == NULL) {
+    printf("ERROR: Out of memory!\n");
+    return -1;
+  }
+  for (blockY = 0; blockY < NUMBLOCKS; blockY++) {
+    job.blockY = blockY;
+    job.next = 0;
+    RunJob(BuildRow, &job);
+    for (blockX = 0; blockX < NUMBLOCKS; blockX++) {
+      for (lod = 0; lod < numLods; lod++)
+        WriteBlock(&writer[lod], blockX, blockY, &job.meshes[blockX * numLods + lod]);
+    }
+  }
+  free(job.meshes);
+
+  for (lod = 0; lod < numLods; lod++) {
+    printf("%s: %u vertices, %u triangles.\n", writer[lod].fileName, writer[lod].numVertices,
+        writer[lod].numTriangles);
+    if (!CloseWriter(&writer[lod]))
+      return -1;
+  }
+
+  return 0;
+}